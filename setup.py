@@ -82,10 +82,12 @@ inside Python, and so on.
 """,
       ext_modules=[
         Extension("lua-python",
-                  ["src/pythoninlua.c", "src/luainpython.c"],
+                  ["src/pythoninlua.c", "src/luainpython.c",
+                   "src/luaarray.c"],
                   **lua_pkgconfig),
         Extension("lua",
-                  ["src/pythoninlua.c", "src/luainpython.c"],
+                  ["src/pythoninlua.c", "src/luainpython.c",
+                   "src/luaarray.c"],
                   **lua_pkgconfig),
         ],
       )
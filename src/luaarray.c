@@ -0,0 +1,786 @@
+/*
+
+ Lunatic Python
+ --------------
+
+ Copyright (c) 2002-2005  Gustavo Niemeyer <gustavo@niemeyer.net>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "pythoninlua.h"
+#include "luainpython.h"
+#include "luaarray.h"
+
+#if LUA_VERSION_NUM >= 503
+#  define array_checkinteger luaL_checkinteger
+#else
+#  define array_checkinteger luaL_checknumber
+#endif
+
+static const struct
+{
+    const char *name;
+    const char *format;
+    const char *typestr;
+    Py_ssize_t itemsize;
+} LuaArray_dtypes[] =
+{
+    {"float64", "d", "f8", sizeof(double)},
+    {"int64",   "q", "i8", sizeof(int64_t)},
+    {"int32",   "i", "i4", sizeof(int32_t)},
+    {"uint8",   "B", "u1", sizeof(uint8_t)},
+    {NULL}
+};
+
+/* An element value on its way in or out of an array: doubles for float64,
+ * 64-bit integers for everything else. */
+typedef struct
+{
+    int isfloat;
+    double d;
+    long long i;
+} LuaArray_scalar;
+
+#define LUA_ARRAY_CASES(M) \
+    case LUA_ARRAY_FLOAT64: M(double); break; \
+    case LUA_ARRAY_INT64:   M(int64_t); break; \
+    case LUA_ARRAY_INT32:   M(int32_t); break; \
+    case LUA_ARRAY_UINT8:   M(uint8_t); break;
+
+#define LUA_ARRAY_INT_CASES(M) \
+    case LUA_ARRAY_INT64:   M(int64_t); break; \
+    case LUA_ARRAY_INT32:   M(int32_t); break; \
+    case LUA_ARRAY_UINT8:   M(uint8_t); break;
+
+static int LuaArray_dtype(const char *name)
+{
+    int i;
+    for (i = 0; LuaArray_dtypes[i].name; i++) {
+        if (strcmp(name, LuaArray_dtypes[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static LuaArray *LuaArray_New(int dtype, Py_ssize_t n)
+{
+    LuaArray *a;
+    Py_ssize_t itemsize = LuaArray_dtypes[dtype].itemsize;
+
+    if (n < 0 || n > PY_SSIZE_T_MAX / itemsize) {
+        PyErr_SetString(PyExc_ValueError, "invalid array size");
+        return NULL;
+    }
+    a = PyObject_New(LuaArray, &LuaArray_Type);
+    if (!a)
+        return NULL;
+    a->data = PyMem_Malloc(n ? n * itemsize : 1);
+    if (!a->data) {
+        a->n = 0;
+        Py_DECREF(a);
+        return (LuaArray *)PyErr_NoMemory();
+    }
+    memset(a->data, 0, n * itemsize);
+    a->n = n;
+    a->itemsize = itemsize;
+    a->dtype = dtype;
+    return a;
+}
+
+static LuaArray_scalar LuaArray_get(LuaArray *a, Py_ssize_t i)
+{
+    LuaArray_scalar v = {a->dtype == LUA_ARRAY_FLOAT64, 0, 0};
+#define GET(T) \
+    if (v.isfloat) v.d = (double)((T *)a->data)[i]; \
+    else v.i = (long long)((T *)a->data)[i]
+    switch (a->dtype) {
+        LUA_ARRAY_CASES(GET)
+    }
+#undef GET
+    return v;
+}
+
+/* Store v at i.  Returns 0 when an integer doesn't fit the element type. */
+static int LuaArray_set(LuaArray *a, Py_ssize_t i, LuaArray_scalar v)
+{
+    switch (a->dtype) {
+        case LUA_ARRAY_FLOAT64:
+            ((double *)a->data)[i] = v.isfloat ? v.d : (double)v.i;
+            break;
+        case LUA_ARRAY_INT64:
+            ((int64_t *)a->data)[i] = (int64_t)v.i;
+            break;
+        case LUA_ARRAY_INT32:
+            if (v.i < INT32_MIN || v.i > INT32_MAX)
+                return 0;
+            ((int32_t *)a->data)[i] = (int32_t)v.i;
+            break;
+        case LUA_ARRAY_UINT8:
+            if (v.i < 0 || v.i > UINT8_MAX)
+                return 0;
+            ((uint8_t *)a->data)[i] = (uint8_t)v.i;
+            break;
+    }
+    return 1;
+}
+
+/* Kernels.  Integer arithmetic wraps around like it does in Lua. */
+
+static LuaArray_scalar LuaArray_sum(LuaArray *a)
+{
+    LuaArray_scalar r = {a->dtype == LUA_ARRAY_FLOAT64, 0, 0};
+    unsigned long long acc = 0;
+    Py_ssize_t i;
+
+    if (r.isfloat) {
+        const double *p = (const double *)a->data;
+        for (i = 0; i < a->n; i++)
+            r.d += p[i];
+        return r;
+    }
+#define SUM(T) \
+    { const T *p = (const T *)a->data; \
+      for (i = 0; i < a->n; i++) acc += (unsigned long long)p[i]; }
+    switch (a->dtype) {
+        LUA_ARRAY_INT_CASES(SUM)
+    }
+#undef SUM
+    r.i = (long long)acc;
+    return r;
+}
+
+/* Smallest (or largest, with max set) element; 0 if the array is empty. */
+static int LuaArray_minmax(LuaArray *a, int max, LuaArray_scalar *out)
+{
+    Py_ssize_t i, best = 0;
+
+    if (a->n == 0)
+        return 0;
+#define MINMAX(T) \
+    { const T *p = (const T *)a->data; \
+      for (i = 1; i < a->n; i++) \
+          if (max ? p[i] > p[best] : p[i] < p[best]) best = i; }
+    switch (a->dtype) {
+        LUA_ARRAY_CASES(MINMAX)
+    }
+#undef MINMAX
+    *out = LuaArray_get(a, best);
+    return 1;
+}
+
+static const char *LuaArray_check_pair(LuaArray *a, LuaArray *b)
+{
+    if (a->dtype != b->dtype)
+        return "array types differ";
+    if (a->n != b->n)
+        return "array sizes differ";
+    return NULL;
+}
+
+static const char *LuaArray_dot(LuaArray *a, LuaArray *b,
+                                LuaArray_scalar *out)
+{
+    const char *err = LuaArray_check_pair(a, b);
+    unsigned long long acc = 0;
+    Py_ssize_t i;
+
+    if (err)
+        return err;
+    out->isfloat = a->dtype == LUA_ARRAY_FLOAT64;
+    out->d = 0;
+    if (out->isfloat) {
+        const double *p = (const double *)a->data;
+        const double *q = (const double *)b->data;
+        for (i = 0; i < a->n; i++)
+            out->d += p[i] * q[i];
+        return NULL;
+    }
+#define DOT(T) \
+    { const T *p = (const T *)a->data, *q = (const T *)b->data; \
+      for (i = 0; i < a->n; i++) \
+          acc += (unsigned long long)p[i] * (unsigned long long)q[i]; }
+    switch (a->dtype) {
+        LUA_ARRAY_INT_CASES(DOT)
+    }
+#undef DOT
+    out->i = (long long)acc;
+    return NULL;
+}
+
+/* a *= alpha, in place. */
+static void LuaArray_scale(LuaArray *a, LuaArray_scalar alpha)
+{
+    Py_ssize_t i;
+
+    if (a->dtype == LUA_ARRAY_FLOAT64) {
+        double *p = (double *)a->data;
+        for (i = 0; i < a->n; i++)
+            p[i] *= alpha.d;
+        return;
+    }
+#define SCALE(T) \
+    { T *p = (T *)a->data; \
+      for (i = 0; i < a->n; i++) \
+          p[i] = (T)((unsigned long long)p[i] * (unsigned long long)alpha.i); }
+    switch (a->dtype) {
+        LUA_ARRAY_INT_CASES(SCALE)
+    }
+#undef SCALE
+}
+
+/* y += alpha * x, in place. */
+static const char *LuaArray_axpy(LuaArray *y, LuaArray_scalar alpha,
+                                 LuaArray *x)
+{
+    const char *err = LuaArray_check_pair(y, x);
+    Py_ssize_t i;
+
+    if (err)
+        return err;
+    if (y->dtype == LUA_ARRAY_FLOAT64) {
+        double *p = (double *)y->data;
+        const double *q = (const double *)x->data;
+        for (i = 0; i < y->n; i++)
+            p[i] += alpha.d * q[i];
+        return NULL;
+    }
+#define AXPY(T) \
+    { T *p = (T *)y->data; const T *q = (const T *)x->data; \
+      for (i = 0; i < y->n; i++) \
+          p[i] = (T)((unsigned long long)p[i] + \
+                     (unsigned long long)alpha.i * (unsigned long long)q[i]); }
+    switch (y->dtype) {
+        LUA_ARRAY_INT_CASES(AXPY)
+    }
+#undef AXPY
+    return NULL;
+}
+
+/* Python side */
+
+static int LuaArray_from_py(PyObject *o, int isfloat, LuaArray_scalar *v)
+{
+    v->isfloat = isfloat;
+    v->d = 0;
+    v->i = 0;
+    if (isfloat) {
+        v->d = PyFloat_AsDouble(o);
+        return v->d == -1.0 && PyErr_Occurred() ? -1 : 0;
+    }
+    v->i = PyLong_AsLongLong(o);
+    return v->i == -1 && PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject *LuaArray_to_py(LuaArray_scalar v)
+{
+    if (v.isfloat)
+        return PyFloat_FromDouble(v.d);
+    return PyLong_FromLongLong(v.i);
+}
+
+static int LuaArray_fill(LuaArray *a, PyObject *seq)
+{
+    Py_ssize_t i;
+    LuaArray_scalar v;
+
+    for (i = 0; i != a->n; i++) {
+        if (LuaArray_from_py(PySequence_Fast_GET_ITEM(seq, i),
+                             a->dtype == LUA_ARRAY_FLOAT64, &v) < 0)
+            return -1;
+        if (!LuaArray_set(a, i, v)) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "value out of range for array type");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* lua.array(dtype, size_or_iterable) */
+static PyObject *LuaArray_tp_new(PyTypeObject *type, PyObject *args,
+                                 PyObject *kwargs)
+{
+    const char *name;
+    PyObject *init, *seq;
+    LuaArray *a;
+    int dtype;
+
+    if (!PyArg_ParseTuple(args, "sO", &name, &init))
+        return NULL;
+
+    dtype = LuaArray_dtype(name);
+    if (dtype < 0) {
+        PyErr_Format(PyExc_ValueError, "unknown array type '%s'", name);
+        return NULL;
+    }
+
+    if (PyLong_Check(init)) {
+        Py_ssize_t n = PyLong_AsSsize_t(init);
+        if (n == -1 && PyErr_Occurred())
+            return NULL;
+        return (PyObject *)LuaArray_New(dtype, n);
+    }
+
+    seq = PySequence_Fast(init, "size or iterable expected");
+    if (!seq)
+        return NULL;
+    a = LuaArray_New(dtype, PySequence_Fast_GET_SIZE(seq));
+    if (a && LuaArray_fill(a, seq) < 0)
+        Py_CLEAR(a);
+    Py_DECREF(seq);
+    return (PyObject *)a;
+}
+
+static void LuaArray_dealloc(LuaArray *self)
+{
+    PyMem_Free(self->data);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *LuaArray_repr(LuaArray *self)
+{
+    return PyUnicode_FromFormat("<lua.array %s[%zd] at %p>",
+                                LuaArray_dtypes[self->dtype].name,
+                                self->n, (void *)self->data);
+}
+
+static Py_ssize_t LuaArray_length(LuaArray *self)
+{
+    return self->n;
+}
+
+static PyObject *LuaArray_item(LuaArray *self, Py_ssize_t i)
+{
+    if (i < 0 || i >= self->n) {
+        PyErr_SetString(PyExc_IndexError, "array index out of range");
+        return NULL;
+    }
+    return LuaArray_to_py(LuaArray_get(self, i));
+}
+
+static int LuaArray_ass_item(LuaArray *self, Py_ssize_t i, PyObject *value)
+{
+    LuaArray_scalar v;
+
+    if (i < 0 || i >= self->n) {
+        PyErr_SetString(PyExc_IndexError, "array index out of range");
+        return -1;
+    }
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "array items can't be deleted");
+        return -1;
+    }
+    if (LuaArray_from_py(value, self->dtype == LUA_ARRAY_FLOAT64, &v) < 0)
+        return -1;
+    if (!LuaArray_set(self, i, v)) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "value out of range for array type");
+        return -1;
+    }
+    return 0;
+}
+
+static int LuaArray_getbuffer(LuaArray *self, Py_buffer *view, int flags)
+{
+    view->buf = self->data;
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->len = self->n * self->itemsize;
+    view->readonly = 0;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ?
+        (char *)LuaArray_dtypes[self->dtype].format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->n : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? &self->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyObject *LuaArray_array_interface(LuaArray *self, void *closure)
+{
+    static const uint16_t one = 1;
+    char typestr[4];
+
+    typestr[0] = self->itemsize == 1 ? '|' :
+                 *(const char *)&one ? '<' : '>';
+    strcpy(typestr + 1, LuaArray_dtypes[self->dtype].typestr);
+    return Py_BuildValue("{s:(n),s:s,s:(NO),s:i}",
+                         "shape", self->n,
+                         "typestr", typestr,
+                         "data", PyLong_FromVoidPtr(self->data), Py_False,
+                         "version", 3);
+}
+
+static PyObject *LuaArray_dtype_get(LuaArray *self, void *closure)
+{
+    return PyUnicode_FromString(LuaArray_dtypes[self->dtype].name);
+}
+
+static PyObject *LuaArray_py_sum(LuaArray *self, PyObject *unused)
+{
+    return LuaArray_to_py(LuaArray_sum(self));
+}
+
+static PyObject *LuaArray_py_minmax(LuaArray *self, int max)
+{
+    LuaArray_scalar v;
+    if (!LuaArray_minmax(self, max, &v)) {
+        PyErr_SetString(PyExc_ValueError, "empty array");
+        return NULL;
+    }
+    return LuaArray_to_py(v);
+}
+
+static PyObject *LuaArray_py_min(LuaArray *self, PyObject *unused)
+{
+    return LuaArray_py_minmax(self, 0);
+}
+
+static PyObject *LuaArray_py_max(LuaArray *self, PyObject *unused)
+{
+    return LuaArray_py_minmax(self, 1);
+}
+
+static PyObject *LuaArray_py_dot(LuaArray *self, PyObject *other)
+{
+    LuaArray_scalar v;
+    const char *err;
+
+    if (!LuaArray_Check(other)) {
+        PyErr_SetString(PyExc_TypeError, "lua.array expected");
+        return NULL;
+    }
+    err = LuaArray_dot(self, (LuaArray *)other, &v);
+    if (err) {
+        PyErr_SetString(PyExc_ValueError, err);
+        return NULL;
+    }
+    return LuaArray_to_py(v);
+}
+
+static PyObject *LuaArray_py_scale(LuaArray *self, PyObject *alpha)
+{
+    LuaArray_scalar v;
+    if (LuaArray_from_py(alpha, self->dtype == LUA_ARRAY_FLOAT64, &v) < 0)
+        return NULL;
+    LuaArray_scale(self, v);
+    Py_RETURN_NONE;
+}
+
+static PyObject *LuaArray_py_axpy(LuaArray *self, PyObject *args)
+{
+    PyObject *alpha;
+    LuaArray *x;
+    LuaArray_scalar v;
+    const char *err;
+
+    if (!PyArg_ParseTuple(args, "OO!", &alpha, &LuaArray_Type, &x))
+        return NULL;
+    if (LuaArray_from_py(alpha, self->dtype == LUA_ARRAY_FLOAT64, &v) < 0)
+        return NULL;
+    err = LuaArray_axpy(self, v, x);
+    if (err) {
+        PyErr_SetString(PyExc_ValueError, err);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef LuaArray_methods[] =
+{
+    {"sum",     (PyCFunction)LuaArray_py_sum,   METH_NOARGS,  NULL},
+    {"min",     (PyCFunction)LuaArray_py_min,   METH_NOARGS,  NULL},
+    {"max",     (PyCFunction)LuaArray_py_max,   METH_NOARGS,  NULL},
+    {"dot",     (PyCFunction)LuaArray_py_dot,   METH_O,       NULL},
+    {"scale",   (PyCFunction)LuaArray_py_scale, METH_O,       NULL},
+    {"axpy",    (PyCFunction)LuaArray_py_axpy,  METH_VARARGS, NULL},
+    {NULL,      NULL}
+};
+
+static PyGetSetDef LuaArray_getset[] =
+{
+    {"__array_interface__", (getter)LuaArray_array_interface, NULL, NULL},
+    {"dtype",   (getter)LuaArray_dtype_get,     NULL,         NULL},
+    {NULL}
+};
+
+static PySequenceMethods LuaArray_as_sequence = {
+    .sq_length = (lenfunc)LuaArray_length,
+    .sq_item = (ssizeargfunc)LuaArray_item,
+    .sq_ass_item = (ssizeobjargproc)LuaArray_ass_item,
+};
+
+static PyBufferProcs LuaArray_as_buffer = {
+    .bf_getbuffer = (getbufferproc)LuaArray_getbuffer,
+};
+
+PyTypeObject LuaArray_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "lua.array",
+    .tp_basicsize = sizeof(LuaArray),
+    .tp_dealloc = (destructor)LuaArray_dealloc,
+    .tp_repr = (reprfunc)LuaArray_repr,
+    .tp_as_sequence = &LuaArray_as_sequence,
+    .tp_as_buffer = &LuaArray_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "typed numeric array shared with lua",
+    .tp_methods = LuaArray_methods,
+    .tp_getset = LuaArray_getset,
+    .tp_new = LuaArray_tp_new,
+    .tp_free = PyObject_Del,
+};
+
+/* Lua side: PARRAY userdata holding a reference to the LuaArray. */
+
+static LuaArray *array_check(lua_State *L, int n)
+{
+    return *(LuaArray **)luaL_checkudata(L, n, PARRAY);
+}
+
+static LuaArray_scalar array_checkvalue(lua_State *L, int n, LuaArray *a)
+{
+    LuaArray_scalar v = {a->dtype == LUA_ARRAY_FLOAT64, 0, 0};
+    if (v.isfloat)
+        v.d = (double)luaL_checknumber(L, n);
+    else
+        v.i = (long long)array_checkinteger(L, n);
+    return v;
+}
+
+static void array_pushvalue(lua_State *L, LuaArray_scalar v)
+{
+    if (v.isfloat)
+        lua_pushnumber(L, (lua_Number)v.d);
+    else
+        lua_pushinteger(L, (lua_Integer)v.i);
+}
+
+/* 1-based Lua index to element offset, or -1 when out of range. */
+static Py_ssize_t array_offset(lua_State *L, LuaArray *a, int n)
+{
+    lua_Number i;
+    if (lua_type(L, n) != LUA_TNUMBER)
+        return -1;
+    i = lua_tonumber(L, n);
+    if (i < 1 || i > (lua_Number)a->n || i != (lua_Number)(Py_ssize_t)i)
+        return -1;
+    return (Py_ssize_t)i - 1;
+}
+
+int luaPy_push_array(lua_State *L, PyObject *o)
+{
+    LuaArray **ud = (LuaArray **)lua_newuserdata(L, sizeof(LuaArray *));
+    Py_INCREF(o);
+    *ud = (LuaArray *)o;
+    luaL_getmetatable(L, PARRAY);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+PyObject *luaPy_to_array(lua_State *L, int n)
+{
+    int is_parray;
+    if (!lua_getmetatable(L, n)) return NULL;
+    luaL_getmetatable(L, PARRAY);
+    is_parray = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return is_parray ? *(PyObject **)lua_touserdata(L, n) : NULL;
+}
+
+/* python.array(dtype, size_or_table) */
+int py_array(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    int dtype = LuaArray_dtype(name);
+    Py_ssize_t i, n;
+    LuaArray *a;
+
+    if (dtype < 0)
+        return luaL_argerror(L, 1, "unknown array type");
+    if (lua_istable(L, 2))
+        n = (Py_ssize_t)lua_rawlen(L, 2);
+    else
+        n = (Py_ssize_t)luaL_checknumber(L, 2);
+
+    a = LuaArray_New(dtype, n);
+    if (!a) {
+        PyErr_Clear();
+        return luaL_error(L, "failed to create array");
+    }
+    luaPy_push_array(L, (PyObject *)a);
+    Py_DECREF(a);
+
+    if (lua_istable(L, 2)) {
+        for (i = 0; i != n; i++) {
+            lua_rawgeti(L, 2, (int)i+1);
+            if (!LuaArray_set(a, i, array_checkvalue(L, -1, a)))
+                return luaL_error(L, "value out of range for array type");
+            lua_pop(L, 1);
+        }
+    }
+    return 1;
+}
+
+static int array_index(lua_State *L)
+{
+    LuaArray *a = array_check(L, 1);
+    Py_ssize_t i = array_offset(L, a, 2);
+
+    if (i < 0) {
+        /* Not an element: look it up in the methods table. */
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        return 1;
+    }
+    array_pushvalue(L, LuaArray_get(a, i));
+    return 1;
+}
+
+static int array_newindex(lua_State *L)
+{
+    LuaArray *a = array_check(L, 1);
+    Py_ssize_t i = array_offset(L, a, 2);
+
+    if (i < 0)
+        return luaL_error(L, "array index out of range");
+    if (!LuaArray_set(a, i, array_checkvalue(L, 3, a)))
+        return luaL_error(L, "value out of range for array type");
+    return 0;
+}
+
+static int array_len(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)array_check(L, 1)->n);
+    return 1;
+}
+
+static int array_gc(lua_State *L)
+{
+    LuaArray **ud = (LuaArray **)luaL_checkudata(L, 1, PARRAY);
+    Py_DECREF(*ud);
+    return 0;
+}
+
+static int array_tostring(lua_State *L)
+{
+    LuaArray *a = array_check(L, 1);
+    lua_pushfstring(L, "python array %s[%d]: %p",
+                    LuaArray_dtypes[a->dtype].name, (int)a->n,
+                    (void *)a->data);
+    return 1;
+}
+
+static int array_sum(lua_State *L)
+{
+    array_pushvalue(L, LuaArray_sum(array_check(L, 1)));
+    return 1;
+}
+
+static int array_minmax(lua_State *L, int max)
+{
+    LuaArray_scalar v;
+    if (!LuaArray_minmax(array_check(L, 1), max, &v))
+        return luaL_error(L, "empty array");
+    array_pushvalue(L, v);
+    return 1;
+}
+
+static int array_min(lua_State *L)
+{
+    return array_minmax(L, 0);
+}
+
+static int array_max(lua_State *L)
+{
+    return array_minmax(L, 1);
+}
+
+static int array_dot(lua_State *L)
+{
+    LuaArray_scalar v;
+    const char *err = LuaArray_dot(array_check(L, 1), array_check(L, 2), &v);
+    if (err)
+        return luaL_error(L, "%s", err);
+    array_pushvalue(L, v);
+    return 1;
+}
+
+static int array_scale(lua_State *L)
+{
+    LuaArray *a = array_check(L, 1);
+    LuaArray_scale(a, array_checkvalue(L, 2, a));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int array_axpy(lua_State *L)
+{
+    LuaArray *y = array_check(L, 1);
+    const char *err = LuaArray_axpy(y, array_checkvalue(L, 2, y),
+                                    array_check(L, 3));
+    if (err)
+        return luaL_error(L, "%s", err);
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* Only dropping the array needs Python; everything else works on the
+ * data and runs without the GIL. */
+make_pyentry(array_gc);
+
+static const luaL_Reg array_mt[] =
+{
+    {"__newindex",  array_newindex},
+    {"__len",   array_len},
+    {"__tostring",  array_tostring},
+    {NULL, NULL}
+};
+
+static const luaL_Reg array_methods[] =
+{
+    {"sum",     array_sum},
+    {"min",     array_min},
+    {"max",     array_max},
+    {"dot",     array_dot},
+    {"scale",   array_scale},
+    {"axpy",    array_axpy},
+    {NULL, NULL}
+};
+
+void luaopen_array(lua_State *L)
+{
+    luaL_newmetatable(L, PARRAY);
+    luaL_setfuncs(L, array_mt, 0);
+    lua_pushcfunction(L, array_gc_entry);
+    LuaGIL_wrap(L);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, array_methods);
+    lua_pushcclosure(L, array_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+}
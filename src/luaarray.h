@@ -0,0 +1,57 @@
+/*
+
+ Lunatic Python
+ --------------
+
+ Copyright (c) 2002-2005  Gustavo Niemeyer <gustavo@niemeyer.net>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef LUAARRAY_H
+#define LUAARRAY_H
+
+#define PARRAY "PARRAY"
+
+enum
+{
+    LUA_ARRAY_FLOAT64,
+    LUA_ARRAY_INT64,
+    LUA_ARRAY_INT32,
+    LUA_ARRAY_UINT8,
+};
+
+/* Fixed-size typed array shared by both sides: Python sees the buffer
+ * protocol, Lua sees PARRAY userdata reading the same memory. */
+typedef struct
+{
+    PyObject_HEAD
+    char *data;
+    Py_ssize_t n;
+    Py_ssize_t itemsize;
+    int dtype;
+} LuaArray;
+
+extern PyTypeObject LuaArray_Type;
+
+#define LuaArray_Check(op) PyObject_TypeCheck(op, &LuaArray_Type)
+
+int       py_array(lua_State *L);
+
+int       luaPy_push_array(lua_State *L, PyObject *o);
+PyObject* luaPy_to_array(lua_State *L, int n);
+void      luaopen_array(lua_State *L);
+
+#endif
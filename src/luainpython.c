@@ -31,23 +31,493 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 #include "pythoninlua.h"
 #include "luainpython.h"
+#include "luaarray.h"
 
 lua_State *LuaState = NULL;
 
+#if PY_VERSION_HEX >= 0x03080000
+static PyObject *LuaObject_vectorcall(PyObject *obj, PyObject *const *args,
+                                      size_t nargsf, PyObject *kwnames);
+#endif
+
+/* Registry field holding a light reference to a state's LuaStateObject. */
+#define LUA_STATE_KEY "lunatic.state"
+
+static LuaStateObject *LuaDefaultState = NULL;
+
+/* The State object for L, which may be any thread of the state.  States
+ * created elsewhere, such as by a Lua host, get a wrapper the first time
+ * they are seen; it is never freed, as the Lua side owns the state.
+ * Returns a borrowed reference. */
+LuaStateObject *LuaStateObject_For(lua_State *L)
+{
+    LuaStateObject *state;
+
+    if (L == LuaState && LuaDefaultState)
+        return LuaDefaultState;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_STATE_KEY);
+    state = (LuaStateObject *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (state)
+        return state;
+
+    state = PyObject_New(LuaStateObject, &LuaStateObject_Type);
+    if (!state)
+        return NULL;
+#if LUA_VERSION_NUM >= 502
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+    state->L = lua_tothread(L, -1);
+    lua_pop(L, 1);
+#else
+    state->L = L;
+#endif
+    state->owned = 0;
+    state->nogil = LuaGILHost;
+    state->owner = 0;
+    state->depth = 0;
+    state->host = PyThread_get_thread_ident();
+    state->traceback = 0;
+    state->strmode = LUA_STRMODE_STR;
+    state->strcache = NULL;
+    state->pool = NULL;
+    state->lock = PyThread_allocate_lock();
+    if (!state->lock) {
+        PyObject_Del(state);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    lua_pushlightuserdata(L, state);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_STATE_KEY);
+    return state;
+}
+
+/* The state a module function or State method works on. */
+static LuaStateObject *Lua_state(PyObject *self)
+{
+    if (self && LuaStateObject_Check(self))
+        return (LuaStateObject *)self;
+    return LuaDefaultState;
+}
+
+/* Whether the state belongs to a Lua host thread other than this one.
+ * The host keeps running Lua code on it without taking the lock, so no
+ * other thread may touch it. */
+static int LuaState_foreign(LuaStateObject *state)
+{
+    return !state->owned && LuaGILHost &&
+           state->host != PyThread_get_thread_ident();
+}
+
+/* Take the state's lock.  Waiting gives up the GIL, as the holder may
+ * need it to finish; a thread already holding the lock, such as one
+ * called back from the Lua code it is running, just goes deeper.
+ * Returns -1 with RuntimeError set for a foreign thread. */
+static int LuaState_lock(LuaStateObject *state)
+{
+    unsigned long self = PyThread_get_thread_ident();
+
+    if (LuaState_foreign(state)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Lua state is owned by another thread");
+        return -1;
+    }
+    if (state->depth && state->owner == self) {
+        state->depth++;
+        return 0;
+    }
+    if (!PyThread_acquire_lock(state->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(state->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    state->owner = self;
+    state->depth = 1;
+    return 0;
+}
+
+static void LuaState_unlock(LuaStateObject *state)
+{
+    if (--state->depth == 0) {
+        state->owner = 0;
+        PyThread_release_lock(state->lock);
+    }
+}
+
+#if defined(_MSC_VER)
+#  define LUA_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#  define LUA_THREAD_LOCAL __thread
+#else
+#  define LUA_THREAD_LOCAL _Thread_local
+#endif
+
+/* The thread state saved while this thread runs Lua code without the
+ * GIL, or NULL while it holds the GIL. */
+static LUA_THREAD_LOCAL PyThreadState *LuaReleased = NULL;
+
+/* Set when a Lua host initialized Python: the GIL is then released
+ * between calls, as any number of host threads may enter Python. */
+int LuaGILHost = 0;
+
+/* Protected call on a locked state, running the Lua code without the
+ * GIL when the state allows it.  Anything entering Python from there
+ * takes the GIL back through LuaGIL_call.  If it raises, the error
+ * unwinds with the GIL held and it is not given up again. */
+static int Lua_pcall(LuaStateObject *state, int nargs, int nresults,
+                     int msgh)
+{
+    int rc;
+
+    if (!state->nogil)
+        return lua_pcall(state->L, nargs, nresults, msgh);
+    LuaReleased = PyEval_SaveThread();
+    rc = lua_pcall(state->L, nargs, nresults, msgh);
+    if (LuaReleased)
+        PyEval_RestoreThread(LuaReleased);
+    LuaReleased = NULL;
+    return rc;
+}
+
+/* Called for every Lua C function that uses Python, to run it with the
+ * GIL held: Lua code run from Python without the GIL gets it back for
+ * the call.  A Lua host takes it in LuaGIL_entry instead. */
+int LuaGIL_call(lua_State *L, lua_CFunction func)
+{
+    PyThreadState *tstate = LuaReleased;
+    int ret;
+
+    if (tstate) {
+        LuaReleased = NULL;
+        PyEval_RestoreThread(tstate);
+        ret = func(L);
+        LuaReleased = PyEval_SaveThread();
+        return ret;
+    }
+    return func(L);
+}
+
+/* What a Lua host calls instead of a function using Python: runs the
+ * function in upvalue 1 in protected mode with the GIL taken through
+ * PyGILState_Ensure, so that the GIL is given back before any error
+ * unwinds past it. */
+static int LuaGIL_entry(lua_State *L)
+{
+    PyGILState_STATE gstate;
+    LuaStateObject *state;
+    int rc;
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    if (LuaReleased) {
+        /* Lua code run from Python: the function takes the GIL back. */
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+    gstate = PyGILState_Ensure();
+    state = LuaStateObject_For(L);
+    if (!state) {
+        PyGILState_Release(gstate);
+        return luaL_error(L, "out of memory");
+    }
+    if (!state->owned)
+        state->host = PyThread_get_thread_ident();
+    rc = lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0);
+    PyGILState_Release(gstate);
+    if (rc != 0)
+        return lua_error(L);
+    return lua_gettop(L);
+}
+
+/* Wrap the function on top of the stack in LuaGIL_entry when Lua is
+ * the host.  Done once as functions are registered. */
+void LuaGIL_wrap(lua_State *L)
+{
+    if (LuaGILHost)
+        lua_pushcclosure(L, LuaGIL_entry, 1);
+}
+
+/* luaL_setfuncs without upvalues, for functions that all use Python. */
+void LuaGIL_setfuncs(lua_State *L, const luaL_Reg *l)
+{
+    for (; l->name; l++) {
+        lua_pushcfunction(L, l->func);
+        LuaGIL_wrap(L);
+        lua_setfield(L, -2, l->name);
+    }
+}
+
 static PyObject *LuaObject_New(lua_State *L, int n)
 {
-    LuaObject *obj = PyObject_New(LuaObject, &LuaObject_Type);
+    LuaStateObject *state = LuaStateObject_For(L);
+    LuaObject *obj;
+
+    if (!state)
+        return NULL;
+    obj = PyObject_New(LuaObject, &LuaObject_Type);
     if (obj)
     {
+        Py_INCREF(state);
+        obj->state = state;
         lua_pushvalue(L, n);
         obj->ref = luaL_ref(L, LUA_REGISTRYINDEX);
         obj->refiter = 0;
+        obj->nresults = LUA_MULTRET;
+#if PY_VERSION_HEX >= 0x03080000
+        obj->vectorcall = LuaObject_vectorcall;
+#endif
+    }
+    return (PyObject*) obj;
+}
+
+/* Length of the leading run of ASCII bytes in s[0..len).  Scans 16 bytes
+ * at a time with SSE2 when available, 8 bytes at a time otherwise. */
+static size_t ascii_prefix(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v))
+            break;
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, s + i, 8);
+        if (w & UINT64_C(0x8080808080808080))
+            break;
+    }
+#endif
+    while (i < len && s[i] < 0x80)
+        i++;
+    return i;
+}
+
+/* Strict UTF-8 check (no overlongs, surrogates or code points past
+ * U+10FFFF), matching what PyUnicode_DecodeUTF8 accepts.  ASCII runs
+ * between multi-byte sequences go through ascii_prefix(). */
+static int utf8_valid(const unsigned char *s, size_t len)
+{
+    size_t i = 0;
+    while (i < len) {
+        unsigned char c = s[i];
+        size_t n;
+        if (c < 0x80) {
+            i += ascii_prefix(s + i, len - i);
+            continue;
+        }
+        if (c >= 0xC2 && c <= 0xDF) {
+            n = 1;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            n = 2;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            n = 3;
+        } else {
+            return 0;
+        }
+        if (len - i <= n)
+            return 0;
+        /* The second byte carries the range restrictions. */
+        if ((c == 0xE0 && s[i+1] < 0xA0) ||
+            (c == 0xED && s[i+1] > 0x9F) ||
+            (c == 0xF0 && s[i+1] < 0x90) ||
+            (c == 0xF4 && s[i+1] > 0x8F))
+            return 0;
+        for (i++; n; n--, i++) {
+            if ((s[i] & 0xC0) != 0x80)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/* Build a str from a Lua string, or bytes when it isn't valid UTF-8.
+ * Pure ASCII data becomes a compact 1-byte string with a single memcpy. */
+static PyObject *LuaConvert_string(const char *s, size_t len)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    size_t ascii = ascii_prefix(u, len);
+    PyObject *ret;
+
+#if PY_VERSION_HEX >= 0x03030000
+    if (ascii == len) {
+        ret = PyUnicode_New(len, 127);
+        if (ret)
+            memcpy(PyUnicode_1BYTE_DATA(ret), s, len);
+        return ret;
+    }
+#endif
+    if (utf8_valid(u + ascii, len - ascii))
+        return PyUnicode_DecodeUTF8(s, len, NULL);
+    return PyBytes_FromStringAndSize(s, len);
+}
+
+/* Short Lua strings are interned, so the same field name or tag always
+ * comes back at the same address.  Their conversions are kept in a small
+ * direct-mapped cache keyed on that address, one per state.  Every cached
+ * Lua string is anchored in a table in the state's registry until its
+ * slot is reused, so it can't be collected and have its address recycled
+ * while an entry points at it. */
+#ifndef LUAI_MAXSHORTLEN
+#define LUAI_MAXSHORTLEN 40
+#endif
+#define LUA_STRCACHE_SIZE 1024
+
+struct LuaStringCache
+{
+    const char *s[LUA_STRCACHE_SIZE];
+    PyObject *o[LUA_STRCACHE_SIZE];
+    int anchors;
+};
+
+static PyObject *LuaConvert_cached(LuaStateObject *state, lua_State *L,
+                                   int n, const char *s, size_t len)
+{
+    struct LuaStringCache *cache = state->strcache;
+    uintptr_t p = (uintptr_t)s;
+    size_t slot = (size_t)((p >> 4) ^ (p >> 14)) & (LUA_STRCACHE_SIZE - 1);
+    PyObject *o;
+
+    if (!cache) {
+        cache = PyMem_Malloc(sizeof(*cache));
+        if (!cache)
+            return PyErr_NoMemory();
+        memset(cache, 0, sizeof(*cache));
+        lua_createtable(L, LUA_STRCACHE_SIZE, 0);
+        cache->anchors = luaL_ref(L, LUA_REGISTRYINDEX);
+        state->strcache = cache;
+    }
+    if (cache->s[slot] == s) {
+        o = cache->o[slot];
+        Py_INCREF(o);
+        return o;
+    }
+
+    o = LuaConvert_string(s, len);
+    if (!o)
+        return NULL;
+    if (PyUnicode_CheckExact(o))
+        PyUnicode_InternInPlace(&o);
+
+    if (n < 0 && n > LUA_REGISTRYINDEX)
+        n = lua_gettop(L) + n + 1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cache->anchors);
+    lua_pushvalue(L, n);
+    lua_rawseti(L, -2, (int)slot + 1);
+    lua_pop(L, 1);
+
+    Py_XDECREF(cache->o[slot]);
+    cache->s[slot] = s;
+    cache->o[slot] = o;
+    Py_INCREF(o);
+    return o;
+}
+
+/* Drop the state's string cache; its anchors go with the state. */
+static void LuaStringCache_free(LuaStateObject *state)
+{
+    struct LuaStringCache *cache = state->strcache;
+    int i;
+
+    if (!cache)
+        return;
+    for (i = 0; i != LUA_STRCACHE_SIZE; i++)
+        Py_XDECREF(cache->o[i]);
+    PyMem_Free(cache);
+    state->strcache = NULL;
+}
+
+static PyObject *LuaString_New(lua_State *L, int n, PyTypeObject *type)
+{
+    LuaStateObject *state = LuaStateObject_For(L);
+    LuaString *obj;
+
+    if (!state)
+        return NULL;
+    obj = PyObject_New(LuaString, type);
+    if (obj)
+    {
+        Py_INCREF(state);
+        obj->state = state;
+        obj->s = lua_tolstring(L, n, &obj->len);
+        lua_pushvalue(L, n);
+        obj->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        obj->value = NULL;
+        obj->hash = -1;
     }
     return (PyObject*) obj;
 }
 
+/* Convert the string at index n according to one of the LUA_STRMODE_*
+ * modes.  Callers that need a str regardless of the configured mode,
+ * such as Python dict lookups, pass LUA_STRMODE_STR explicitly. */
+PyObject *LuaConvertString(lua_State *L, int n, int mode)
+{
+    size_t len;
+    const char *s;
+
+    if (mode == LUA_STRMODE_LAZY)
+        return LuaString_New(L, n, &LuaString_Type);
+    if (mode == LUA_STRMODE_BUFFER)
+        return LuaString_New(L, n, &LuaBytes_Type);
+
+    s = lua_tolstring(L, n, &len);
+    if (mode == LUA_STRMODE_BYTES)
+        return PyBytes_FromStringAndSize(s, len);
+    if (len <= LUAI_MAXSHORTLEN) {
+        LuaStateObject *state = LuaStateObject_For(L);
+        if (!state)
+            return NULL;
+        return LuaConvert_cached(state, L, n, s, len);
+    }
+    return LuaConvert_string(s, len);
+}
+
+/* Decoders registered with lua.register_decoder() live in a registry
+ * table mapping a metatable to its Python callable. */
+#define LUA_DECODERS "lunatic.decoders"
+
+static int LuaHasDecoders = 0;
+
+/* Run the decoder registered for the metatable of the value at n, if any.
+ * Returns NULL without an exception set when there is none. */
+static PyObject *LuaConvert_decoded(lua_State *L, int n)
+{
+    PyObject *decoder, *obj, *ret;
+    py_object *dec;
+
+    if (!lua_getmetatable(L, n))
+        return NULL;
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_DECODERS);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        return NULL;
+    }
+    lua_insert(L, -2);
+    lua_rawget(L, -2);
+    dec = luaPy_to_pobject(L, -1);
+    decoder = dec ? dec->o : NULL;
+    Py_XINCREF(decoder);
+    lua_pop(L, 2);
+    if (!decoder)
+        return NULL;
+
+    obj = LuaObject_New(L, n);
+    ret = obj ? PyObject_CallFunctionObjArgs(decoder, obj, NULL) : NULL;
+    Py_XDECREF(obj);
+    Py_DECREF(decoder);
+    return ret;
+}
+
 PyObject *LuaConvert(lua_State *L, int n)
 {
     
@@ -61,24 +531,28 @@ PyObject *LuaConvert(lua_State *L, int n)
             break;
 
         case LUA_TSTRING: {
-            size_t len;
-            const char *s = lua_tolstring(L, n, &len);
-            ret = PyUnicode_FromStringAndSize(s, len);
-            if (!ret)
-            {
-              PyErr_Clear();
-              ret = PyBytes_FromStringAndSize(s, len);
-            }
+            LuaStateObject *state = LuaStateObject_For(L);
+            if (state)
+                ret = LuaConvertString(L, n, state->strmode);
             break;
         }
 
         case LUA_TNUMBER: {
+#if LUA_VERSION_NUM >= 503
+            /* Lua 5.3+ keeps an integer subtype: map it straight to a
+             * Python int and floats to float, without guessing. */
+            if (lua_isinteger(L, n))
+                ret = PyLong_FromLongLong((long long)lua_tointeger(L, n));
+            else
+                ret = PyFloat_FromDouble((double)lua_tonumber(L, n));
+#else
             lua_Number num = lua_tonumber(L, n);
             if (num != (long)num) {
                 ret = PyFloat_FromDouble(num);
             } else {
                 ret = PyLong_FromLong((long)num);
             }
+#endif
             break;
         }
 
@@ -96,9 +570,37 @@ PyObject *LuaConvert(lua_State *L, int n)
                 break;
             }
 
+            ret = luaPy_to_array(L, n);
+            if (ret) {
+                Py_INCREF(ret);
+                break;
+            }
+
+            ret = luaPy_to_pexception(L, n);
+            if (ret) {
+                Py_INCREF(ret);
+                break;
+            }
+
+            py_buffer *buf = luaPy_to_pbuffer(L, n);
+            if (buf && !buf->released && buf->view.obj) {
+                Py_INCREF(buf->view.obj);
+                ret = buf->view.obj;
+                break;
+            }
+
             /* Otherwise go on and handle as custom. */
         }
 
+        case LUA_TTABLE:
+            if (LuaHasDecoders) {
+                ret = LuaConvert_decoded(L, n);
+                if (ret || PyErr_Occurred())
+                    break;
+            }
+            ret = LuaObject_New(L, n);
+            break;
+
         default:
             ret = LuaObject_New(L, n);
             break;
@@ -107,150 +609,358 @@ PyObject *LuaConvert(lua_State *L, int n)
     return ret;
 }
 
-static PyObject *LuaCall(lua_State *L, PyObject *args)
+/* A table is sequence-shaped when its keys are exactly 1..len.  Only the
+ * keys are looked at here; values are converted in a separate pass. */
+static int LuaTable_is_sequence(lua_State *L, int n, size_t len)
+{
+    size_t count = 0;
+
+    if (len == 0)
+        return 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, n) != 0) {
+        lua_Number k;
+        lua_pop(L, 1);
+        k = lua_type(L, -1) == LUA_TNUMBER ? lua_tonumber(L, -1) : 0;
+        if (k < 1 || k > (lua_Number)len || k != (lua_Number)(size_t)k) {
+            lua_pop(L, 1);
+            return 0;
+        }
+        count++;
+    }
+    return count == len;
+}
+
+/* Convert the value at absolute index n, turning tables into list or dict
+ * objects down to depth levels (negative means no limit).  Tables seen
+ * before map to the same Python object, so cycles are preserved. */
+static PyObject *LuaConvertDeep(lua_State *L, int n, int depth, PyObject *seen)
 {
     PyObject *ret = NULL;
-    PyObject *arg;
-#ifdef PY_SSIZE_T_CLEAN
-    Py_ssize_t nargs, i;
-#else
-    int nargs, i;
-#endif
-    int rc;
+    PyObject *id;
+    size_t len;
 
-    if (!PyTuple_Check(args)) {
-        PyErr_SetString(PyExc_TypeError, "tuple expected");
-        lua_settop(L, 0);
+    if (depth == 0 || lua_type(L, n) != LUA_TTABLE)
+        return LuaConvert(L, n);
+
+    id = PyLong_FromVoidPtr((void *)lua_topointer(L, n));
+    if (!id)
         return NULL;
+    ret = PyDict_GetItem(seen, id);
+    if (ret) {
+        Py_DECREF(id);
+        Py_INCREF(ret);
+        return ret;
     }
 
-    nargs = PyTuple_Size(args);
-    for (i = 0; i != nargs; i++) {
-        arg = PyTuple_GetItem(args, i);
-        if (arg == NULL) {
-            PyErr_Format(PyExc_TypeError,
-                     "failed to get tuple item #%d", i);
-            lua_settop(L, 0);
-            return NULL;
+    if (!lua_checkstack(L, 4)) {
+        Py_DECREF(id);
+        return PyErr_NoMemory();
+    }
+    if (Py_EnterRecursiveCall(" while converting a Lua table")) {
+        Py_DECREF(id);
+        return NULL;
+    }
+
+    len = lua_rawlen(L, n);
+    if (LuaTable_is_sequence(L, n, len)) {
+        size_t i;
+        ret = PyList_New(len);
+        if (!ret || PyDict_SetItem(seen, id, ret) < 0)
+            goto error;
+        for (i = 0; i != len; i++) {
+            PyObject *item;
+            lua_rawgeti(L, n, (int)i+1);
+            item = LuaConvertDeep(L, lua_gettop(L), depth-1, seen);
+            lua_pop(L, 1);
+            if (!item)
+                goto error;
+            PyList_SET_ITEM(ret, i, item);
+        }
+    } else {
+        ret = PyDict_New();
+        if (!ret || PyDict_SetItem(seen, id, ret) < 0)
+            goto error;
+        lua_pushnil(L);
+        while (lua_next(L, n) != 0) {
+            PyObject *key = LuaConvert(L, -2);
+            PyObject *value = key ?
+                LuaConvertDeep(L, lua_gettop(L), depth-1, seen) : NULL;
+            int rc = value ? PyDict_SetItem(ret, key, value) : -1;
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+            if (rc < 0) {
+                lua_pop(L, 2);
+                goto error;
+            }
+            lua_pop(L, 1);
+        }
+    }
+
+    Py_LeaveRecursiveCall();
+    Py_DECREF(id);
+    return ret;
+
+error:
+    Py_LeaveRecursiveCall();
+    Py_DECREF(id);
+    Py_XDECREF(ret);
+    return NULL;
+}
+
+/* lua.LuaError, raised for errors coming out of Lua. */
+static PyObject *LuaError;
+
+/* Message handler for protected calls on a state with tracebacks
+ * switched on.  The error value is kept as is; only the Lua traceback is
+ * recorded, under the state's own registry key in upvalue 1, as it is
+ * gone once the stack unwinds.  Python exceptions carry their own. */
+static int LuaError_handler(lua_State *L)
+{
+#if LUA_VERSION_NUM >= 502
+    if (!luaPy_to_pexception(L, 1)) {
+        lua_pushvalue(L, lua_upvalueindex(1));
+        luaL_traceback(L, L, NULL, 1);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+#endif
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* The message handler otherwise: leaves the error value alone. */
+static int LuaError_value(lua_State *L)
+{
+    lua_settop(L, 1);
+    return 1;
+}
+
+/* Push the message handler for a protected call on the state. */
+static void LuaError_pushhandler(LuaStateObject *state)
+{
+    if (state->traceback) {
+        lua_pushlightuserdata(state->L, state);
+        lua_pushcclosure(state->L, LuaError_handler, 1);
+    } else {
+        lua_pushcfunction(state->L, LuaError_value);
+    }
+}
+
+/* Set a Python exception for the Lua error value on top of the stack.  A
+ * Python exception raised through Lua comes back as itself; anything else
+ * becomes a LuaError holding the raw value, with the traceback, when the
+ * state records them, left undecoded until it is read. */
+static void LuaRaise(LuaStateObject *state)
+{
+    lua_State *L = state->L;
+    PyObject *exc = luaPy_to_pexception(L, -1);
+    PyObject *value, *tb = NULL;
+
+    if (exc) {
+        PyErr_SetObject((PyObject *)Py_TYPE(exc), exc);
+        return;
+    }
+
+    if (state->traceback) {
+        lua_pushlightuserdata(L, state);
+        lua_rawget(L, LUA_REGISTRYINDEX);
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            tb = LuaString_New(L, -1, &LuaString_Type);
+            lua_pushlightuserdata(L, state);
+            lua_pushnil(L);
+            lua_rawset(L, LUA_REGISTRYINDEX);
         }
-        rc = py_convert(L, arg);
-        if (!rc) {
+        lua_pop(L, 1);
+        if (!tb && PyErr_Occurred())
+            return;
+    }
+    if (!tb) {
+        Py_INCREF(Py_None);
+        tb = Py_None;
+    }
+
+    value = LuaConvert(L, -1);
+    if (!value) {
+        Py_DECREF(tb);
+        return;
+    }
+    exc = PyObject_CallFunctionObjArgs(LuaError, value, NULL);
+    if (exc &&
+        PyObject_SetAttrString(exc, "value", value) == 0 &&
+        PyObject_SetAttrString(exc, "traceback", tb) == 0)
+        PyErr_SetObject(LuaError, exc);
+    Py_XDECREF(exc);
+    Py_DECREF(value);
+    Py_DECREF(tb);
+}
+
+/* Call the function on top of the stack with args and return its
+ * results.  With LUA_MULTRET a single result comes back bare and several
+ * as a tuple; otherwise exactly nresults are kept, as a tuple when more
+ * than one, with missing ones read as None.  The function and anything
+ * it leaves are popped.  Errors are raised as LuaError.  The caller holds
+ * the state's lock. */
+static PyObject *LuaCallArgs(LuaStateObject *state, PyObject *const *args,
+                             Py_ssize_t nargs, int nresults)
+{
+    lua_State *L = state->L;
+    PyObject *ret = NULL;
+    PyObject *arg;
+    int base = lua_gettop(L) - 1;
+    int i, nret;
+
+    LuaError_pushhandler(state);
+    lua_insert(L, base + 1);
+    if (!lua_checkstack(L, (int)nargs + 1)) {
+        PyErr_SetString(PyExc_RuntimeError, "too many arguments");
+        lua_settop(L, base);
+        return NULL;
+    }
+    for (i = 0; i != nargs; i++) {
+        if (!py_convert(L, args[i])) {
             PyErr_Format(PyExc_TypeError,
                      "failed to convert argument #%d", i);
-            lua_settop(L, 0);
+            lua_settop(L, base);
             return NULL;
         }
     }
 
-    if (lua_pcall(L, nargs, LUA_MULTRET, 0) != 0) {
-        PyErr_Format(PyExc_Exception,
-                 "error: %s", lua_tostring(L, -1));
+    if (Lua_pcall(state, (int)nargs, nresults, base + 1) != 0) {
+        LuaRaise(state);
+        lua_settop(L, base);
         return NULL;
     }
 
-    nargs = lua_gettop(L);
-    if (nargs == 1) {
-        ret = LuaConvert(L, 1);
-        if (!ret) {
+    nret = lua_gettop(L) - base - 1;
+    if (nret == 1) {
+        ret = LuaConvert(L, base + 2);
+        if (!ret)
             PyErr_SetString(PyExc_TypeError,
                         "failed to convert return");
-            lua_settop(L, 0);
-            Py_DECREF(ret);
-            return NULL;
-        }
-    } else if (nargs > 1) {
-        ret = PyTuple_New(nargs);
+    } else if (nret > 1) {
+        ret = PyTuple_New(nret);
         if (!ret) {
             PyErr_SetString(PyExc_RuntimeError,
                     "failed to create return tuple");
-            lua_settop(L, 0);
+            lua_settop(L, base);
             return NULL;
         }
-        for (i = 0; i != nargs; i++) {
-            arg = LuaConvert(L, i+1);
+        for (i = 0; i != nret; i++) {
+            arg = LuaConvert(L, base + i + 2);
             if (!arg) {
                 PyErr_Format(PyExc_TypeError,
                          "failed to convert return #%d", i);
-                lua_settop(L, 0);
-                Py_DECREF(ret);
-                return NULL;
+                Py_CLEAR(ret);
+                break;
             }
-            PyTuple_SetItem(ret, i, arg);
+            PyTuple_SET_ITEM(ret, i, arg);
         }
     } else {
         Py_INCREF(Py_None);
         ret = Py_None;
     }
-    
-    lua_settop(L, 0);
 
+    lua_settop(L, base);
     return ret;
 }
 
+static PyObject *LuaCall(LuaStateObject *state, PyObject *args)
+{
+    if (!PyTuple_Check(args)) {
+        PyErr_SetString(PyExc_TypeError, "tuple expected");
+        lua_pop(state->L, 1);
+        return NULL;
+    }
+    return LuaCallArgs(state, PySequence_Fast_ITEMS(args),
+                       PyTuple_GET_SIZE(args), LUA_MULTRET);
+}
+
+/* Check a requested result count given as nresults=. */
+static int LuaCall_nresults(PyObject *value, int *nresults)
+{
+    long n = PyLong_AsLong(value);
+    if (n == -1 && PyErr_Occurred())
+        return 0;
+    if (n < 0 || n > 255) {
+        PyErr_SetString(PyExc_ValueError,
+                        "nresults must be between 0 and 255");
+        return 0;
+    }
+    *nresults = (int)n;
+    return 1;
+}
+
 static void LuaObject_dealloc(LuaObject *self)
 {
-    luaL_unref(LuaState, LUA_REGISTRYINDEX, self->ref);
-    if (self->refiter)
-        luaL_unref(LuaState, LUA_REGISTRYINDEX, self->refiter);
+    if (self->state) {
+        lua_State *L = self->state->L;
+        /* Dropped by a foreign thread, the ref lives on with the state. */
+        if (!LuaState_foreign(self->state)) {
+            LuaState_lock(self->state);
+            luaL_unref(L, LUA_REGISTRYINDEX, self->ref);
+            if (self->refiter)
+                luaL_unref(L, LUA_REGISTRYINDEX, self->refiter);
+            LuaState_unlock(self->state);
+        }
+        Py_DECREF(self->state);
+    }
     Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
 static PyObject *LuaObject_getattr(PyObject *obj, PyObject *attr)
 {
-    lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
-    if (lua_isnil(LuaState, -1)) {
-        lua_pop(LuaState, 1);
-        PyErr_SetString(PyExc_RuntimeError, "lost reference");
+    LuaStateObject *state = ((LuaObject*)obj)->state;
+    lua_State *L = state->L;
+    PyObject *ret = NULL;
+    int top;
+
+    if (LuaState_lock(state) < 0)
         return NULL;
-    }
-    
-    if (!lua_isstring(LuaState, -1)
-        && !lua_istable(LuaState, -1)
-        && !lua_isuserdata(LuaState, -1))
-    {
-        lua_pop(LuaState, 1);
+    top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    if (lua_isnil(L, -1)) {
+        PyErr_SetString(PyExc_RuntimeError, "lost reference");
+    } else if (!lua_isstring(L, -1)
+               && !lua_istable(L, -1)
+               && !lua_isuserdata(L, -1)) {
         PyErr_SetString(PyExc_RuntimeError, "not an indexable value");
-        return NULL;
-    }
-
-    PyObject *ret = NULL;
-    int rc = py_convert(LuaState, attr);
-    if (rc) {
-        lua_gettable(LuaState, -2);
-        ret = LuaConvert(LuaState, -1);
+    } else if (py_convert(L, attr)) {
+        lua_gettable(L, -2);
+        ret = LuaConvert(L, -1);
     } else {
         PyErr_SetString(PyExc_ValueError, "can't convert attr/key");
     }
-    lua_settop(LuaState, 0);
+    lua_settop(L, top);
+    LuaState_unlock(state);
     return ret;
 }
 
 static int LuaObject_setattr(PyObject *obj, PyObject *attr, PyObject *value)
 {
+    LuaStateObject *state = ((LuaObject*)obj)->state;
+    lua_State *L = state->L;
     int ret = -1;
-    int rc;
-    lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
-    if (lua_isnil(LuaState, -1)) {
-        lua_pop(LuaState, 1);
-        PyErr_SetString(PyExc_RuntimeError, "lost reference");
+    int top, rc;
+
+    if (LuaState_lock(state) < 0)
         return -1;
-    }
-    if (!lua_istable(LuaState, -1)) {
-        lua_pop(LuaState, -1);
+    top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    if (lua_isnil(L, -1)) {
+        PyErr_SetString(PyExc_RuntimeError, "lost reference");
+    } else if (!lua_istable(L, -1)) {
         PyErr_SetString(PyExc_TypeError, "Lua object is not a table");
-        return -1;
-    }
-    rc = py_convert(LuaState, attr);
-    if (rc) {
+    } else if (py_convert(L, attr)) {
         if (NULL == value) {
-            lua_pushnil(LuaState);
+            lua_pushnil(L);
             rc = 1;
         } else {
-            rc = py_convert(LuaState, value);
+            rc = py_convert(L, value);
         }
 
         if (rc) {
-            lua_settable(LuaState, -3);
+            lua_settable(L, -3);
             ret = 0;
         } else {
             PyErr_SetString(PyExc_ValueError,
@@ -259,51 +969,57 @@ static int LuaObject_setattr(PyObject *obj, PyObject *attr, PyObject *value)
     } else {
         PyErr_SetString(PyExc_ValueError, "can't convert key/attr");
     }
-    lua_settop(LuaState, 0);
+    lua_settop(L, top);
+    LuaState_unlock(state);
     return ret;
 }
 
 static PyObject *LuaObject_str(PyObject *obj)
 {
+    LuaStateObject *state = ((LuaObject*)obj)->state;
+    lua_State *L = state->L;
     PyObject *ret = NULL;
     const char *s;
-    lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
-    if (luaL_callmeta(LuaState, -1, "__tostring")) {
-        s = lua_tostring(LuaState, -1);
-        lua_pop(LuaState, 1);
+    if (LuaState_lock(state) < 0)
+        return NULL;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    if (luaL_callmeta(L, -1, "__tostring")) {
+        s = lua_tostring(L, -1);
+        lua_pop(L, 1);
         if (s) ret = PyUnicode_FromString(s);
     }
     if (!ret) {
-        int type = lua_type(LuaState, -1);
+        int type = lua_type(L, -1);
         switch (type) {
             case LUA_TTABLE:
             case LUA_TFUNCTION:
                 ret = PyUnicode_FromFormat("<Lua %s at %p>",
-                    lua_typename(LuaState, type),
-                    lua_topointer(LuaState, -1));
+                    lua_typename(L, type),
+                    lua_topointer(L, -1));
                 break;
             
             case LUA_TUSERDATA:
             case LUA_TLIGHTUSERDATA:
                 ret = PyUnicode_FromFormat("<Lua %s at %p>",
-                    lua_typename(LuaState, type),
-                    lua_touserdata(LuaState, -1));
+                    lua_typename(L, type),
+                    lua_touserdata(L, -1));
                 break;
 
             case LUA_TTHREAD:
                 ret = PyUnicode_FromFormat("<Lua %s at %p>",
-                    lua_typename(LuaState, type),
-                    (void*)lua_tothread(LuaState, -1));
+                    lua_typename(L, type),
+                    (void*)lua_tothread(L, -1));
                 break;
 
             default:
                 ret = PyUnicode_FromFormat("<Lua %s>",
-                    lua_typename(LuaState, type));
+                    lua_typename(L, type));
                 break;
 
         }
     }
-    lua_pop(LuaState, 1);
+    lua_pop(L, 1);
+    LuaState_unlock(state);
     return ret;
 }
 
@@ -341,12 +1057,12 @@ static int LuaObject_pcmp(lua_State *L)
       lua_pushboolean(L, !lua_compare(L, -2, -1, LUA_OPEQ));
       break;
     case Py_GT:
-      lua_insert(LuaState, -2);
+      lua_insert(L, -2);
     case Py_LT:
       lua_pushboolean(L, lua_compare(L, -2, -1, LUA_OPLT));
       break;
     case Py_GE:
-      lua_insert(LuaState, -2);
+      lua_insert(L, -2);
     case Py_LE:
       lua_pushboolean(L, lua_compare(L, -2, -1, LUA_OPLE));
   }
@@ -356,52 +1072,314 @@ static int LuaObject_pcmp(lua_State *L)
 
 static PyObject* LuaObject_richcmp(PyObject *lhs, PyObject *rhs, int op)
 {
-  if (!LuaObject_Check(rhs)) return Py_False;
+  LuaStateObject *state;
+  lua_State *L;
+  int top, ltype, rtype, ret;
 
-  lua_pushcfunction(LuaState, LuaObject_pcmp);
-  lua_pushinteger(LuaState, op);
-  lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject *)lhs)->ref);
-  lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject *)rhs)->ref);
-  if (lua_pcall(LuaState, 3, 1, 0) != LUA_OK)
-  {
-    PyErr_SetString(PyExc_RuntimeError, lua_tostring(LuaState, -1));
+  if (!LuaObject_Check(lhs) || !LuaObject_Check(rhs) ||
+      ((LuaObject *)lhs)->state != ((LuaObject *)rhs)->state)
+    Py_RETURN_NOTIMPLEMENTED;
+
+  state = ((LuaObject *)lhs)->state;
+  L = state->L;
+
+  if (LuaState_lock(state) < 0)
     return NULL;
+  top = lua_gettop(L);
+  lua_pushcfunction(L, LuaObject_pcmp);
+  lua_pushinteger(L, op);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject *)lhs)->ref);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject *)rhs)->ref);
+  ltype = lua_type(L, -2);
+  rtype = lua_type(L, -1);
+
+  /* Metamethods can only be involved when a table or userdata is, so
+   * anything else is compared directly without a protected call. */
+  if ((op == Py_EQ || op == Py_NE) &&
+      (lua_rawequal(L, -2, -1) || ltype != rtype ||
+       (ltype != LUA_TTABLE && ltype != LUA_TUSERDATA)))
+  {
+    ret = lua_rawequal(L, -2, -1) == (op == Py_EQ);
+  }
+  else if (ltype == rtype && (ltype == LUA_TNUMBER || ltype == LUA_TSTRING))
+  {
+    LuaObject_pcmp(L);
+    ret = lua_toboolean(L, -1);
+  }
+  else if (lua_pcall(L, 3, 1, 0) != LUA_OK)
+  {
+    LuaRaise(state);
+    lua_settop(L, top);
+    LuaState_unlock(state);
+    return NULL;
+  }
+  else
+  {
+    ret = lua_toboolean(L, -1);
+  }
+  lua_settop(L, top);
+  LuaState_unlock(state);
+  return PyBool_FromLong(ret);
+}
+
+#if LUA_VERSION_NUM >= 502
+static int LuaObject_parith(lua_State *L)
+{
+  lua_arith(L, (int)lua_tointeger(L, 1));
+  return 1;
+}
+
+/* Operands that can take part in Lua arithmetic.  Other Python objects
+ * would come back through their own metamethods, and bools as Lua
+ * booleans, so they are left to Python instead. */
+static int LuaObject_arith_operand(PyObject *o)
+{
+  return LuaObject_Check(o) ||
+         (PyLong_Check(o) && !PyBool_Check(o)) || PyFloat_Check(o) ||
+         LuaString_Check(o) || PyUnicode_Check(o) || PyBytes_Check(o);
+}
+
+/* The metamethod Lua looks up for an arithmetic operator. */
+static const char *LuaObject_arith_event(int op)
+{
+  switch (op)
+  {
+    case LUA_OPADD: return "__add";
+    case LUA_OPSUB: return "__sub";
+    case LUA_OPMUL: return "__mul";
+    case LUA_OPDIV: return "__div";
+    case LUA_OPMOD: return "__mod";
+    case LUA_OPPOW: return "__pow";
+    case LUA_OPUNM: return "__unm";
+#if LUA_VERSION_NUM >= 503
+    case LUA_OPIDIV: return "__idiv";
+    case LUA_OPBAND: return "__band";
+    case LUA_OPBOR:  return "__bor";
+    case LUA_OPBXOR: return "__bxor";
+    case LUA_OPSHL:  return "__shl";
+    case LUA_OPSHR:  return "__shr";
+    case LUA_OPBNOT: return "__bnot";
+#endif
+  }
+  return NULL;
+}
+
+/* How Lua takes the operand: 0 for numbers and strings, 1 for a value
+ * with the metamethod, -1 for one it would raise on. */
+static int LuaObject_arith_kind(lua_State *L, PyObject *o, const char *event)
+{
+  int type, found;
+
+  if (!o || !LuaObject_Check(o))
+    return 0;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject *)o)->ref);
+  type = lua_type(L, -1);
+  if (type == LUA_TNUMBER || type == LUA_TSTRING)
+  {
+    lua_pop(L, 1);
+    return 0;
+  }
+  found = luaL_getmetafield(L, -1, event) ? 1 : 0;
+  lua_pop(L, found + 1);
+  return found ? 1 : -1;
+}
+
+/* Apply a Lua arithmetic operator, honouring metamethods; b is NULL for
+ * unary operators. */
+static PyObject *LuaObject_arith(PyObject *a, PyObject *b, int op)
+{
+  LuaObject *obj = (LuaObject *)(LuaObject_Check(a) ? a : b);
+  lua_State *L;
+  PyObject *ret;
+  int top, ka, kb;
+
+  if (!LuaObject_arith_operand(a) || (b && !LuaObject_arith_operand(b)) ||
+      (b && LuaObject_Check(a) && LuaObject_Check(b) &&
+       ((LuaObject *)a)->state != ((LuaObject *)b)->state))
+    Py_RETURN_NOTIMPLEMENTED;
+
+  L = obj->state->L;
+  if (LuaState_lock(obj->state) < 0)
+    return NULL;
+  top = lua_gettop(L);
+
+  /* A table or userdata without the metamethod would only make Lua
+   * raise; let Python try the other operand and raise TypeError. */
+  ka = LuaObject_arith_kind(L, a, LuaObject_arith_event(op));
+  kb = LuaObject_arith_kind(L, b, LuaObject_arith_event(op));
+  if ((ka < 0 || kb < 0) && ka != 1 && kb != 1)
+  {
+    LuaState_unlock(obj->state);
+    Py_RETURN_NOTIMPLEMENTED;
+  }
+
+  lua_pushcfunction(L, LuaObject_parith);
+  lua_pushinteger(L, op);
+  if (!py_convert(L, a) || (b && !py_convert(L, b)))
+  {
+    if (!PyErr_Occurred())
+      PyErr_SetString(PyExc_TypeError, "failed to convert operand");
+    ret = NULL;
+  }
+  else if (lua_pcall(L, b ? 3 : 2, 1, 0) != LUA_OK)
+  {
+    LuaRaise(obj->state);
+    ret = NULL;
+  }
+  else
+  {
+    ret = LuaConvert(L, -1);
   }
-  return LuaConvert(LuaState, -1);
+  lua_settop(L, top);
+  LuaState_unlock(obj->state);
+  return ret;
+}
+
+#define make_luaoperator(opname, luaop) \
+  static PyObject *LuaObject_ ## opname(PyObject *a, PyObject *b) \
+  { \
+    return LuaObject_arith(a, b, luaop); \
+  } \
+  struct opname ## __LINE__ // force semi
+
+make_luaoperator(add, LUA_OPADD);
+make_luaoperator(sub, LUA_OPSUB);
+make_luaoperator(mul, LUA_OPMUL);
+make_luaoperator(truediv, LUA_OPDIV);
+make_luaoperator(mod, LUA_OPMOD);
+#if LUA_VERSION_NUM >= 503
+make_luaoperator(floordiv, LUA_OPIDIV);
+make_luaoperator(and, LUA_OPBAND);
+make_luaoperator(or, LUA_OPBOR);
+make_luaoperator(xor, LUA_OPBXOR);
+make_luaoperator(lshift, LUA_OPSHL);
+make_luaoperator(rshift, LUA_OPSHR);
+#endif
+
+static PyObject *LuaObject_pow(PyObject *a, PyObject *b, PyObject *mod)
+{
+  if (mod != Py_None)
+    Py_RETURN_NOTIMPLEMENTED;
+  return LuaObject_arith(a, b, LUA_OPPOW);
+}
+
+static PyObject *LuaObject_neg(PyObject *a)
+{
+  return LuaObject_arith(a, NULL, LUA_OPUNM);
+}
+
+#if LUA_VERSION_NUM >= 503
+static PyObject *LuaObject_invert(PyObject *a)
+{
+  return LuaObject_arith(a, NULL, LUA_OPBNOT);
+}
+#endif
+
+static PyNumberMethods LuaObject_as_number = {
+  .nb_add = LuaObject_add,
+  .nb_subtract = LuaObject_sub,
+  .nb_multiply = LuaObject_mul,
+  .nb_true_divide = LuaObject_truediv,
+  .nb_remainder = LuaObject_mod,
+  .nb_power = LuaObject_pow,
+  .nb_negative = LuaObject_neg,
+#if LUA_VERSION_NUM >= 503
+  .nb_floor_divide = LuaObject_floordiv,
+  .nb_and = LuaObject_and,
+  .nb_or = LuaObject_or,
+  .nb_xor = LuaObject_xor,
+  .nb_lshift = LuaObject_lshift,
+  .nb_rshift = LuaObject_rshift,
+  .nb_invert = LuaObject_invert,
+#endif
+};
+#endif
+
+static PyObject *LuaObject_call(PyObject *obj, PyObject *args,
+                                PyObject *kwargs)
+{
+    LuaStateObject *state = ((LuaObject*)obj)->state;
+    PyObject *ret;
+    int nresults = ((LuaObject*)obj)->nresults;
+
+    if (kwargs && PyDict_Size(kwargs)) {
+        PyObject *value = PyDict_GetItemString(kwargs, "nresults");
+        if (!value || PyDict_Size(kwargs) != 1) {
+            PyErr_SetString(PyExc_TypeError,
+                "Lua functions only take the nresults keyword argument");
+            return NULL;
+        }
+        if (!LuaCall_nresults(value, &nresults))
+            return NULL;
+    }
+    if (LuaState_lock(state) < 0)
+        return NULL;
+    lua_rawgeti(state->L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    ret = LuaCallArgs(state, PySequence_Fast_ITEMS(args),
+                      PyTuple_GET_SIZE(args), nresults);
+    LuaState_unlock(state);
+    return ret;
 }
 
-static PyObject *LuaObject_call(PyObject *obj, PyObject *args)
+#if PY_VERSION_HEX >= 0x03080000
+/* Called with the arguments in place, skipping the args tuple. */
+static PyObject *LuaObject_vectorcall(PyObject *obj, PyObject *const *args,
+                                      size_t nargsf, PyObject *kwnames)
 {
-    lua_settop(LuaState, 0);
-    lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
-    return LuaCall(LuaState, args);
+    LuaStateObject *state = ((LuaObject*)obj)->state;
+    PyObject *ret;
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    int nresults = ((LuaObject*)obj)->nresults;
+
+    if (kwnames && PyTuple_GET_SIZE(kwnames)) {
+        if (PyTuple_GET_SIZE(kwnames) != 1 ||
+            PyUnicode_CompareWithASCIIString(PyTuple_GET_ITEM(kwnames, 0),
+                                             "nresults") != 0) {
+            PyErr_SetString(PyExc_TypeError,
+                "Lua functions only take the nresults keyword argument");
+            return NULL;
+        }
+        if (!LuaCall_nresults(args[nargs], &nresults))
+            return NULL;
+    }
+    if (LuaState_lock(state) < 0)
+        return NULL;
+    lua_rawgeti(state->L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    ret = LuaCallArgs(state, args, nargs, nresults);
+    LuaState_unlock(state);
+    return ret;
 }
+#endif
 
 static PyObject *LuaObject_iternext(LuaObject *obj)
 {
+    lua_State *L = LuaObject_L(obj);
     PyObject *ret = NULL;
 
-    lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    if (LuaState_lock(obj->state) < 0)
+        return NULL;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
 
     if (obj->refiter == 0)
-        lua_pushnil(LuaState);
+        lua_pushnil(L);
     else
-        lua_rawgeti(LuaState, LUA_REGISTRYINDEX, obj->refiter);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, obj->refiter);
 
-    if (lua_next(LuaState, -2) != 0) {
+    if (lua_next(L, -2) != 0) {
         /* Remove value. */
-        lua_pop(LuaState, 1);
-        ret = LuaConvert(LuaState, -1);
+        lua_pop(L, 1);
+        ret = LuaConvert(L, -1);
         /* Save key for next iteration. */
         if (!obj->refiter)
-            obj->refiter = luaL_ref(LuaState, LUA_REGISTRYINDEX);
+            obj->refiter = luaL_ref(L, LUA_REGISTRYINDEX);
         else
-            lua_rawseti(LuaState, LUA_REGISTRYINDEX, obj->refiter);
+            lua_rawseti(L, LUA_REGISTRYINDEX, obj->refiter);
     } else if (obj->refiter) {
-        luaL_unref(LuaState, LUA_REGISTRYINDEX, obj->refiter);
+        luaL_unref(L, LUA_REGISTRYINDEX, obj->refiter);
         obj->refiter = 0;
     }
 
+    LuaState_unlock(obj->state);
     return ret;
 }
 
@@ -416,9 +1394,16 @@ static int LuaObject_length(LuaObject *obj)
 #else
     int len;
 #endif
-    lua_rawgeti(LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
-    len = luaL_len(LuaState, -1);
-    lua_settop(LuaState, 0);
+    lua_State *L = LuaObject_L(obj);
+    int top;
+
+    if (LuaState_lock(obj->state) < 0)
+        return -1;
+    top = lua_gettop(L);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    len = luaL_len(L, -1);
+    lua_settop(L, top);
+    LuaState_unlock(obj->state);
     return len;
 }
 
@@ -449,12 +1434,21 @@ PyTypeObject LuaObject_Type = {
     .tp_basicsize = sizeof(LuaObject),
     .tp_dealloc = (destructor)LuaObject_dealloc,
     .tp_repr = LuaObject_str,
+#if LUA_VERSION_NUM >= 502
+    .tp_as_number = &LuaObject_as_number,
+#endif
     .tp_as_mapping = &LuaObject_as_mapping,
     .tp_call = (ternaryfunc)LuaObject_call,
     .tp_str = LuaObject_str,
     .tp_getattro = LuaObject_getattr,
     .tp_setattro = LuaObject_setattr,
+#if PY_VERSION_HEX >= 0x03080000
+    .tp_vectorcall_offset = offsetof(LuaObject, vectorcall),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+                Py_TPFLAGS_HAVE_VECTORCALL,
+#else
     .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+#endif
     .tp_doc = "custom lua object",
     .tp_richcompare = LuaObject_richcmp,
     .tp_iter = PyObject_SelfIter,
@@ -464,9 +1458,367 @@ PyTypeObject LuaObject_Type = {
     .tp_free = PyObject_Del,
 };
 
-PyObject *Lua_run(PyObject *args, int eval)
+static void LuaString_dealloc(LuaString *self)
 {
-    PyObject *ret;
+    if (self->state) {
+        if (!LuaState_foreign(self->state)) {
+            LuaState_lock(self->state);
+            luaL_unref(self->state->L, LUA_REGISTRYINDEX, self->ref);
+            LuaState_unlock(self->state);
+        }
+        Py_DECREF(self->state);
+    }
+    Py_XDECREF(self->value);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Decode on first use and cache the result.  Returns a borrowed
+ * reference, or NULL with UnicodeDecodeError set. */
+static PyObject *LuaString_value(LuaString *self)
+{
+    if (!self->value)
+        self->value = PyUnicode_DecodeUTF8(self->s, self->len, NULL);
+    return self->value;
+}
+
+static PyObject *LuaString_str(LuaString *self)
+{
+    PyObject *ret = LuaString_value(self);
+    Py_XINCREF(ret);
+    return ret;
+}
+
+static PyObject *LuaString_repr(LuaString *self)
+{
+    return PyUnicode_FromFormat("<Lua string at %p>", (void *)self->s);
+}
+
+static Py_hash_t LuaString_hash(LuaString *self)
+{
+    PyObject *value = LuaString_value(self);
+    PyObject *b;
+    Py_hash_t h;
+
+    if (value)
+        return PyObject_Hash(value);
+
+    /* Not text: it can only equal other LuaStrings, so any stable
+     * hash of the raw bytes will do. */
+    PyErr_Clear();
+    b = PyBytes_FromStringAndSize(self->s, self->len);
+    if (!b)
+        return -1;
+    h = PyObject_Hash(b);
+    Py_DECREF(b);
+    return h;
+}
+
+static PyObject *LuaString_richcmp(PyObject *lhs, PyObject *rhs, int op)
+{
+    LuaString *self = (LuaString *)lhs;
+    PyObject *value;
+    int eq;
+
+    if (op != Py_EQ && op != Py_NE)
+        Py_RETURN_NOTIMPLEMENTED;
+
+    if (LuaString_Check(rhs)) {
+        LuaString *other = (LuaString *)rhs;
+        eq = self->len == other->len &&
+             memcmp(self->s, other->s, self->len) == 0;
+    } else if (PyUnicode_Check(rhs)) {
+        value = LuaString_value(self);
+        if (!value) {
+            PyErr_Clear();
+            eq = 0;
+        } else {
+            eq = PyUnicode_Compare(value, rhs) == 0;
+        }
+    } else {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    if (eq == (op == Py_EQ))
+        Py_RETURN_TRUE;
+    Py_RETURN_FALSE;
+}
+
+static Py_ssize_t LuaString_length(LuaString *self)
+{
+    return (Py_ssize_t)self->len;
+}
+
+static PyObject *LuaString_bytes(LuaString *self, PyObject *unused)
+{
+    return PyBytes_FromStringAndSize(self->s, self->len);
+}
+
+static PyObject *LuaString_decode(LuaString *self, PyObject *args)
+{
+    const char *encoding = "utf-8";
+    const char *errors = NULL;
+
+    if (!PyArg_ParseTuple(args, "|ss", &encoding, &errors))
+        return NULL;
+    return PyUnicode_Decode(self->s, self->len, encoding, errors);
+}
+
+static PyMethodDef LuaString_methods[] =
+{
+    {"__bytes__",  (PyCFunction)LuaString_bytes,  METH_NOARGS,  NULL},
+    {"decode",     (PyCFunction)LuaString_decode, METH_VARARGS, NULL},
+    {NULL,         NULL}
+};
+
+static PySequenceMethods LuaString_as_sequence = {
+    .sq_length = (lenfunc)LuaString_length,
+};
+
+PyTypeObject LuaString_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "lua.LuaString",
+    .tp_basicsize = sizeof(LuaString),
+    .tp_dealloc = (destructor)LuaString_dealloc,
+    .tp_repr = (reprfunc)LuaString_repr,
+    .tp_as_sequence = &LuaString_as_sequence,
+    .tp_hash = (hashfunc)LuaString_hash,
+    .tp_str = (reprfunc)LuaString_str,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "undecoded lua string",
+    .tp_richcompare = LuaString_richcmp,
+    .tp_methods = LuaString_methods,
+    .tp_free = PyObject_Del,
+};
+
+static PyObject *LuaBytes_repr(LuaString *self)
+{
+    return PyUnicode_FromFormat("<Lua bytes at %p>", (void *)self->s);
+}
+
+static Py_hash_t LuaBytes_hash(LuaString *self)
+{
+    /* Hash like the equal bytes object would.  Without Py_HashBuffer the
+     * string is copied once into a bytes object to hash it. */
+    if (self->hash == -1) {
+#if PY_VERSION_HEX >= 0x030E0000
+        self->hash = Py_HashBuffer(self->s, (Py_ssize_t)self->len);
+#else
+        PyObject *b = PyBytes_FromStringAndSize(self->s,
+                                                (Py_ssize_t)self->len);
+        if (!b)
+            return -1;
+        self->hash = PyObject_Hash(b);
+        Py_DECREF(b);
+#endif
+    }
+    return self->hash;
+}
+
+static PyObject *LuaBytes_richcmp(PyObject *lhs, PyObject *rhs, int op)
+{
+    LuaString *self = (LuaString *)lhs;
+    Py_buffer other;
+    int eq;
+
+    if (op != Py_EQ && op != Py_NE)
+        Py_RETURN_NOTIMPLEMENTED;
+    if (PyUnicode_Check(rhs) || LuaString_Check(rhs) ||
+        PyObject_GetBuffer(rhs, &other, PyBUF_SIMPLE) < 0) {
+        PyErr_Clear();
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    eq = (size_t)other.len == self->len &&
+         memcmp(self->s, other.buf, self->len) == 0;
+    PyBuffer_Release(&other);
+
+    if (eq == (op == Py_EQ))
+        Py_RETURN_TRUE;
+    Py_RETURN_FALSE;
+}
+
+static int LuaBytes_getbuffer(LuaString *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, (void *)self->s,
+                             (Py_ssize_t)self->len, 1, flags);
+}
+
+static PyBufferProcs LuaBytes_as_buffer = {
+    .bf_getbuffer = (getbufferproc)LuaBytes_getbuffer,
+};
+
+PyTypeObject LuaBytes_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "lua.LuaBytes",
+    .tp_basicsize = sizeof(LuaString),
+    .tp_dealloc = (destructor)LuaString_dealloc,
+    .tp_repr = (reprfunc)LuaBytes_repr,
+    .tp_as_sequence = &LuaString_as_sequence,
+    .tp_hash = (hashfunc)LuaBytes_hash,
+    .tp_as_buffer = &LuaBytes_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "read-only buffer over a lua string",
+    .tp_richcompare = LuaBytes_richcmp,
+    .tp_methods = LuaString_methods,
+    .tp_free = PyObject_Del,
+};
+
+/* Lazy iterator running a Lua function over a Python iterable.  Items
+ * are pulled one chunk at a time, only once the consumer has used up the
+ * previous results, so memory stays bounded by the chunk size and the
+ * function is pushed once per chunk.  A nil result drops the item. */
+typedef struct
+{
+    PyObject_HEAD
+    LuaStateObject *state;
+    int ref;
+    PyObject *it;
+    PyObject **buf;
+    Py_ssize_t n, pos, chunk;
+} LuaStream;
+
+static PyObject *LuaStream_new(PyTypeObject *type, PyObject *args,
+                               PyObject *kwargs)
+{
+    static char *kwlist[] = {"func", "iterable", "chunk", NULL};
+    PyObject *func, *iterable;
+    Py_ssize_t chunk = 256;
+    LuaStream *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|n:stream", kwlist,
+                                     &func, &iterable, &chunk))
+        return NULL;
+    if (chunk < 1) {
+        PyErr_SetString(PyExc_ValueError, "chunk must be positive");
+        return NULL;
+    }
+
+    self = (LuaStream *)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->ref = LUA_NOREF;
+    self->chunk = chunk;
+    self->it = PyObject_GetIter(iterable);
+    self->buf = PyMem_New(PyObject *, chunk);
+    if (!self->it || !self->buf) {
+        if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        Py_DECREF(self);
+        return NULL;
+    }
+    /* Run in the function's own state, or the default one for Python
+     * callables. */
+    self->state = LuaObject_Check(func) ? ((LuaObject *)func)->state
+                                        : LuaDefaultState;
+    Py_INCREF(self->state);
+    if (LuaState_lock(self->state) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    if (py_convert(self->state->L, func))
+        self->ref = luaL_ref(self->state->L, LUA_REGISTRYINDEX);
+    LuaState_unlock(self->state);
+    if (self->ref == LUA_NOREF) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "failed to convert function");
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static void LuaStream_dealloc(LuaStream *self)
+{
+    if (self->state) {
+        if (!LuaState_foreign(self->state)) {
+            LuaState_lock(self->state);
+            luaL_unref(self->state->L, LUA_REGISTRYINDEX, self->ref);
+            LuaState_unlock(self->state);
+        }
+        Py_DECREF(self->state);
+    }
+    while (self->pos < self->n)
+        Py_DECREF(self->buf[self->pos++]);
+    PyMem_Free(self->buf);
+    Py_XDECREF(self->it);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Run the function over the next chunk of items, keeping the non-nil
+ * results.  Returns 0 with an exception set on failure. */
+static int LuaStream_fill(LuaStream *self)
+{
+    lua_State *L = self->state->L;
+    PyObject *item, *value;
+    Py_ssize_t i;
+    int base;
+
+    if (LuaState_lock(self->state) < 0)
+        return 0;
+    base = lua_gettop(L);
+    self->n = self->pos = 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+    for (i = 0; i != self->chunk; i++) {
+        item = PyIter_Next(self->it);
+        if (!item) {
+            if (PyErr_Occurred())
+                goto error;
+            Py_CLEAR(self->it);
+            break;
+        }
+        lua_pushvalue(L, base + 1);
+        if (PyTuple_Check(item))
+            value = LuaCallArgs(self->state, PySequence_Fast_ITEMS(item),
+                                PyTuple_GET_SIZE(item), 1);
+        else
+            value = LuaCallArgs(self->state, &item, 1, 1);
+        Py_DECREF(item);
+        if (!value)
+            goto error;
+        if (value == Py_None)
+            Py_DECREF(value);
+        else
+            self->buf[self->n++] = value;
+    }
+    lua_settop(L, base);
+    LuaState_unlock(self->state);
+    return 1;
+
+error:
+    lua_settop(L, base);
+    LuaState_unlock(self->state);
+    while (self->n)
+        Py_DECREF(self->buf[--self->n]);
+    return 0;
+}
+
+static PyObject *LuaStream_iternext(LuaStream *self)
+{
+    while (self->pos == self->n) {
+        if (!self->it || !LuaStream_fill(self))
+            return NULL;
+    }
+    return self->buf[self->pos++];
+}
+
+static PyTypeObject LuaStream_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "lua.stream",
+    .tp_basicsize = sizeof(LuaStream),
+    .tp_dealloc = (destructor)LuaStream_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "stream(func, iterable, chunk=256) -> lazy results of func",
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)LuaStream_iternext,
+    .tp_new = LuaStream_new,
+    .tp_free = PyObject_Del,
+};
+
+PyObject *Lua_run(LuaStateObject *state, PyObject *args, int eval)
+{
+    lua_State *L = state->L;
+    PyObject *ret = NULL;
+    int top;
     char *buf = NULL;
     char *s;
 #ifdef PY_SSIZE_T_CLEAN
@@ -486,92 +1838,1104 @@ PyObject *Lua_run(PyObject *args, int eval)
         len = strlen("return ")+len;
     }
 
-    if (luaL_loadbuffer(LuaState, s, len, "<python>") != 0) {
-        PyErr_Format(PyExc_RuntimeError,
-                 "error loading code: %s",
-                 lua_tostring(LuaState, -1));
+    if (LuaState_lock(state) < 0) {
         free(buf);
         return NULL;
     }
-
-    free(buf);
-    
-    if (lua_pcall(LuaState, 0, 1, 0) != 0) {
-        PyErr_Format(PyExc_RuntimeError,
-                 "error executing code: %s",
-                 lua_tostring(LuaState, -1));
-        return NULL;
+    top = lua_gettop(L);
+    if (luaL_loadbuffer(L, s, len, "<python>") != 0) {
+        LuaRaise(state);
+    } else {
+        LuaError_pushhandler(state);
+        lua_insert(L, -2);
+        if (Lua_pcall(state, 0, 1, -2) != 0)
+            LuaRaise(state);
+        else
+            ret = LuaConvert(L, -1);
     }
-
-    ret = LuaConvert(LuaState, -1);
-    lua_settop(LuaState, 0);
+    lua_settop(L, top);
+    LuaState_unlock(state);
+    free(buf);
     return ret;
 }
 
 PyObject *Lua_execute(PyObject *self, PyObject *args)
 {
-    return Lua_run(args, 0);
+    return Lua_run(Lua_state(self), args, 0);
 }
 
 PyObject *Lua_eval(PyObject *self, PyObject *args)
 {
-    return Lua_run(args, 1);
+    return Lua_run(Lua_state(self), args, 1);
 }
 
 PyObject *Lua_globals(PyObject *self, PyObject *args)
 {
+    LuaStateObject *state = Lua_state(self);
+    lua_State *L = state->L;
     PyObject *ret = NULL;
-    lua_getglobal(LuaState, "_G");
-    if (lua_isnil(LuaState, -1)) {
+    if (LuaState_lock(state) < 0)
+        return NULL;
+    lua_getglobal(L, "_G");
+    if (lua_isnil(L, -1)) {
         PyErr_SetString(PyExc_RuntimeError,
                 "lost globals reference");
-        lua_pop(LuaState, 1);
-        return NULL;
+    } else {
+        ret = LuaConvert(L, -1);
+        if (!ret)
+            PyErr_Format(PyExc_TypeError,
+                         "failed to convert globals table");
     }
-    ret = LuaConvert(LuaState, -1);
-    if (!ret)
-        PyErr_Format(PyExc_TypeError,
-                     "failed to convert globals table");
-    lua_settop(LuaState, 0);
+    lua_pop(L, 1);
+    LuaState_unlock(state);
     return ret;
 }
 
 static PyObject *Lua_require(PyObject *self, PyObject *args)
 {
-    lua_getglobal(LuaState, "require");
-    if (lua_isnil(LuaState, -1)) {
-        lua_pop(LuaState, 1);
-        PyErr_SetString(PyExc_RuntimeError, "require is not defined");
+    LuaStateObject *state = Lua_state(self);
+    lua_State *L = state->L;
+    PyObject *ret;
+
+    if (LuaState_lock(state) < 0)
         return NULL;
+    lua_getglobal(L, "require");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        PyErr_SetString(PyExc_RuntimeError, "require is not defined");
+        ret = NULL;
+    } else {
+        ret = LuaCall(state, args);
     }
-    return LuaCall(LuaState, args);
+    LuaState_unlock(state);
+    return ret;
 }
 
-static PyMethodDef lua_methods[] =
+/* lua.map(func, iterable) calls func once per item, unpacking tuples
+ * into several arguments, and returns the first result of each call in
+ * a list.  The function stays on the stack for the whole batch, in its
+ * own state when it is a Lua function. */
+static PyObject *Lua_map(PyObject *self, PyObject *args)
 {
-    {"execute",    Lua_execute,    METH_VARARGS,        NULL},
-    {"eval",       Lua_eval,       METH_VARARGS,        NULL},
-    {"globals",    Lua_globals,    METH_NOARGS,         NULL},
-    {"require",    Lua_require,    METH_VARARGS,        NULL},
-    {NULL,         NULL}
-};
+    LuaStateObject *state = Lua_state(self);
+    lua_State *L;
+    PyObject *func, *iterable, *seq, *item, *value;
+    PyObject *ret;
+    Py_ssize_t i, n;
+    int base;
 
-#if PY_MAJOR_VERSION >= 3
-static struct PyModuleDef lua_module =
-{
-    PyModuleDef_HEAD_INIT,
-    "lua",
-    "Lunatic-Python Python-Lua bridge",
-    -1,
-    lua_methods
-};
-#endif
+    if (!PyArg_ParseTuple(args, "OO:map", &func, &iterable))
+        return NULL;
+    if (LuaObject_Check(func))
+        state = ((LuaObject *)func)->state;
+    L = state->L;
+    /* A private copy: every call gives up the GIL, and the caller's
+     * list could change in the meantime. */
+    seq = PySequence_Tuple(iterable);
+    if (!seq)
+        return NULL;
+    n = PyTuple_GET_SIZE(seq);
+    ret = PyList_New(n);
+    if (!ret) {
+        Py_DECREF(seq);
+        return NULL;
+    }
 
-PyMODINIT_FUNC PyInit_lua(void)
+    if (LuaState_lock(state) < 0) {
+        Py_DECREF(seq);
+        Py_DECREF(ret);
+        return NULL;
+    }
+    base = lua_gettop(L);
+    if (!py_convert(L, func)) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_TypeError, "failed to convert function");
+        Py_CLEAR(ret);
+        n = 0;
+    }
+    for (i = 0; i != n; i++) {
+        item = PyTuple_GET_ITEM(seq, i);
+        lua_pushvalue(L, base + 1);
+        if (PyTuple_Check(item))
+            value = LuaCallArgs(state, PySequence_Fast_ITEMS(item),
+                                PyTuple_GET_SIZE(item), 1);
+        else
+            value = LuaCallArgs(state, &item, 1, 1);
+        if (!value) {
+            Py_CLEAR(ret);
+            break;
+        }
+        PyList_SET_ITEM(ret, i, value);
+    }
+    lua_settop(L, base);
+    LuaState_unlock(state);
+    Py_DECREF(seq);
+    return ret;
+}
+
+/* Resolve a dotted path such as "json.encode" from the globals once and
+ * return the function pinned by a single reference, with its result
+ * count fixed unless overridden per call. */
+static PyObject *Lua_bind(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-  PyObject *m;
-  if (PyType_Ready(&LuaObject_Type) < 0 ||
-#if PY_MAJOR_VERSION >= 3
+    LuaStateObject *state = Lua_state(self);
+    lua_State *L = state->L;
+    static char *kwlist[] = {"path", "nresults", NULL};
+    PyObject *nresults = Py_None;
+    PyObject *ret = NULL;
+    const char *path, *dot;
+    int n = LUA_MULTRET;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|O:bind", kwlist,
+                                     &path, &nresults))
+        return NULL;
+    if (nresults != Py_None && !LuaCall_nresults(nresults, &n))
+        return NULL;
+
+    if (LuaState_lock(state) < 0)
+        return NULL;
+    lua_pushglobaltable(L);
+    for (;;) {
+        dot = strchr(path, '.');
+        if (!lua_istable(L, -1)) {
+            PyErr_Format(PyExc_LookupError,
+                         "cannot index a non-table at '%s'", path);
+            goto done;
+        }
+        lua_pushlstring(L, path, dot ? (size_t)(dot - path)
+                                            : strlen(path));
+        lua_gettable(L, -2);
+        lua_remove(L, -2);
+        if (!dot)
+            break;
+        path = dot + 1;
+    }
+
+    if (!lua_isfunction(L, -1)) {
+        if (!luaL_getmetafield(L, -1, "__call")) {
+            PyErr_SetString(PyExc_TypeError,
+                            "bound object is not callable");
+            goto done;
+        }
+        lua_pop(L, 1);
+    }
+    ret = LuaObject_New(L, -1);
+    if (ret)
+        ((LuaObject*)ret)->nresults = n;
+done:
+    lua_pop(L, 1);
+    LuaState_unlock(state);
+    return ret;
+}
+
+static PyObject *Lua_to_python(PyObject *self, PyObject *args,
+                               PyObject *kwargs)
+{
+    static char *kwlist[] = {"obj", "deep", "max_depth", NULL};
+    PyObject *obj, *seen, *ret;
+    lua_State *L;
+    PyObject *max_depth = Py_None;
+    int deep = 1;
+    int depth = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO", kwlist,
+                                     &obj, &deep, &max_depth))
+        return NULL;
+
+    if (max_depth != Py_None) {
+        depth = (int)PyLong_AsLong(max_depth);
+        if (depth == -1 && PyErr_Occurred())
+            return NULL;
+        if (depth < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "max_depth must be non-negative");
+            return NULL;
+        }
+    }
+    if (!deep && depth != 0)
+        depth = 1;
+
+    if (!LuaObject_Check(obj)) {
+        Py_INCREF(obj);
+        return obj;
+    }
+
+    seen = PyDict_New();
+    if (!seen)
+        return NULL;
+    L = LuaObject_L(obj);
+    if (LuaState_lock(((LuaObject*)obj)->state) < 0) {
+        Py_DECREF(seen);
+        return NULL;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
+    ret = LuaConvertDeep(L, lua_gettop(L), depth, seen);
+    lua_pop(L, 1);
+    LuaState_unlock(((LuaObject*)obj)->state);
+    Py_DECREF(seen);
+    return ret;
+}
+
+static int LuaTable_build(lua_State *L)
+{
+    PyObject *o = (PyObject *)lua_touserdata(L, 1);
+    return py_convert_table(L, o, lua_toboolean(L, 2));
+}
+
+static PyObject *Lua_table(PyObject *self, PyObject *args,
+                           PyObject *kwargs)
+{
+    static char *kwlist[] = {"obj", "deep", NULL};
+    LuaStateObject *state = Lua_state(self);
+    lua_State *L = state->L;
+    PyObject *obj, *ret;
+    int deep = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist,
+                                     &obj, &deep))
+        return NULL;
+
+    if (!PyDict_Check(obj) && !PyList_Check(obj) && !PyTuple_Check(obj)) {
+        PyErr_SetString(PyExc_TypeError, "dict, list or tuple expected");
+        return NULL;
+    }
+
+    /* Building the table may raise Lua errors, so run it protected. */
+    if (LuaState_lock(state) < 0)
+        return NULL;
+    lua_pushcfunction(L, LuaTable_build);
+    lua_pushlightuserdata(L, obj);
+    lua_pushboolean(L, deep);
+    if (lua_pcall(L, 2, 1, 0) != 0) {
+        LuaRaise(state);
+        ret = NULL;
+    } else {
+        ret = LuaConvert(L, -1);
+    }
+    lua_pop(L, 1);
+    LuaState_unlock(state);
+    return ret;
+}
+
+static PyObject *Lua_register_encoder(PyObject *self, PyObject *args)
+{
+    PyObject *type, *func = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O!|O", &PyType_Type, &type, &func))
+        return NULL;
+    if (func != Py_None && !PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_TypeError, "encoder must be callable");
+        return NULL;
+    }
+    if (py_register_encoder(type, func == Py_None ? NULL : func) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *Lua_register_decoder(PyObject *self, PyObject *args)
+{
+    PyObject *mt, *func = Py_None;
+    lua_State *L;
+
+    if (!PyArg_ParseTuple(args, "O!|O", &LuaObject_Type, &mt, &func))
+        return NULL;
+    if (func != Py_None && !PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_TypeError, "decoder must be callable");
+        return NULL;
+    }
+
+    L = LuaObject_L(mt);
+    if (LuaState_lock(((LuaObject*)mt)->state) < 0)
+        return NULL;
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_DECODERS);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_DECODERS);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)mt)->ref);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 2);
+        LuaState_unlock(((LuaObject*)mt)->state);
+        PyErr_SetString(PyExc_TypeError, "metatable must be a Lua table");
+        return NULL;
+    }
+    py_convert(L, func);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    LuaState_unlock(((LuaObject*)mt)->state);
+
+    if (func != Py_None)
+        LuaHasDecoders = 1;
+    Py_RETURN_NONE;
+}
+
+static const char *const LuaStringModes[] =
+{
+    "str", "bytes", "lazy", "buffer", NULL
+};
+
+/* lua.string_mode([mode]) selects how LuaConvert returns Lua strings
+ * from the state, and returns the previous mode. */
+static PyObject *Lua_string_mode(PyObject *self, PyObject *args)
+{
+    LuaStateObject *state = Lua_state(self);
+    const char *mode = NULL;
+    int old = state->strmode;
+    int i;
+
+    if (!PyArg_ParseTuple(args, "|s", &mode))
+        return NULL;
+
+    if (mode) {
+        for (i = 0; LuaStringModes[i]; i++) {
+            if (strcmp(mode, LuaStringModes[i]) == 0)
+                break;
+        }
+        if (!LuaStringModes[i]) {
+            PyErr_Format(PyExc_ValueError,
+                         "unknown string mode '%s'", mode);
+            return NULL;
+        }
+        state->strmode = i;
+    }
+
+    return PyUnicode_FromString(LuaStringModes[old]);
+}
+
+/* lua.tracebacks([enabled]) switches recording the Lua traceback of
+ * errors raised as LuaError on or off for the state, and returns the
+ * previous setting.  Off by default, as the traceback is formatted on
+ * every failing call. */
+static PyObject *Lua_tracebacks(PyObject *self, PyObject *args)
+{
+    LuaStateObject *state = Lua_state(self);
+    PyObject *enabled = NULL;
+    int old = state->traceback;
+
+    if (!PyArg_ParseTuple(args, "|O:tracebacks", &enabled))
+        return NULL;
+    if (enabled) {
+        int on = PyObject_IsTrue(enabled);
+        if (on < 0)
+            return NULL;
+        state->traceback = on;
+    }
+    return PyBool_FromLong(old);
+}
+
+/* Open a fresh state with the standard libraries and the python module,
+ * and register the State object that will own it. */
+static lua_State *Lua_open(LuaStateObject *state)
+{
+    lua_State *L = luaL_newstate();
+    if (!L)
+        return NULL;
+    if (state) {
+        lua_pushlightuserdata(L, state);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUA_STATE_KEY);
+    }
+    luaL_openlibs(L);
+    /* Mark the module as loaded, so that require 'python' returns it
+     * instead of loading a second copy that shares none of our state. */
+#if LUA_VERSION_NUM >= 502
+    luaL_requiref(L, "python", luaopen_python, 0);
+#else
+    lua_pushcfunction(L, luaopen_python);
+    lua_call(L, 0, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, "python");
+#endif
+    lua_settop(L, 0);
+    return L;
+}
+
+static PyObject *LuaStateObject_new(PyTypeObject *type, PyObject *args,
+                                    PyObject *kwargs)
+{
+    static char *kwlist[] = {NULL};
+    LuaStateObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":State", kwlist))
+        return NULL;
+    self = (LuaStateObject *)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->lock = PyThread_allocate_lock();
+    self->L = self->lock ? Lua_open(self) : NULL;
+    if (!self->L) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    self->owned = 1;
+    self->nogil = 1;
+    return (PyObject *)self;
+}
+
+static void LuaStateObject_dealloc(LuaStateObject *self)
+{
+    if (self->owned && self->L)
+        lua_close(self->L);
+    LuaStringCache_free(self);
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+    Py_XDECREF(self->pool);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *LuaStateObject_repr(LuaStateObject *self)
+{
+    return PyUnicode_FromFormat("<Lua state at %p>", (void *)self->L);
+}
+
+/* lua.StatePool: states opened and initialized up front, waiting in a
+ * queue.Queue until a thread checks one out. */
+typedef struct
+{
+    PyObject_HEAD
+    PyObject *idle;
+    Py_ssize_t size;
+} LuaPool;
+
+/* Registry field holding the globals a pooled state starts from. */
+#define LUA_BASELINE_KEY "lunatic.baseline"
+
+/* Record the current globals as the ones to go back to on reset. */
+static void LuaStateObject_snapshot(LuaStateObject *self)
+{
+    lua_State *L = self->L;
+
+    LuaState_lock(self);
+    lua_newtable(L);
+    lua_pushglobaltable(L);
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -5);
+    }
+    lua_pop(L, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_BASELINE_KEY);
+    LuaState_unlock(self);
+}
+
+/* Put the globals back as they were in the snapshot: globals added
+ * since are cleared and reassigned or removed ones restored.  Tables
+ * reached from the globals keep any changes made inside them. */
+static void LuaStateObject_reset(LuaStateObject *self)
+{
+    lua_State *L = self->L;
+    int top;
+
+    LuaState_lock(self);
+    top = lua_gettop(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, LUA_BASELINE_KEY);
+    if (lua_istable(L, -1)) {
+        lua_pushglobaltable(L);
+        /* Clearing or assigning existing fields is fine while
+         * traversing. */
+        lua_pushnil(L);
+        while (lua_next(L, top + 2) != 0) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, top + 1);
+            if (!lua_rawequal(L, -1, -2)) {
+                lua_pushvalue(L, -3);
+                lua_insert(L, -2);
+                lua_rawset(L, top + 2);
+            } else {
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+        lua_pushnil(L);
+        while (lua_next(L, top + 1) != 0) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, top + 2);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_pushvalue(L, -2);
+                lua_insert(L, -2);
+                lua_rawset(L, top + 2);
+            } else {
+                lua_pop(L, 2);
+            }
+        }
+    }
+    lua_settop(L, top);
+    LuaState_unlock(self);
+}
+
+static PyObject *LuaStateObject_enter(PyObject *self, PyObject *unused)
+{
+    Py_INCREF(self);
+    return self;
+}
+
+/* Reset a state checked out from a StatePool and hand it back to it.
+ * Returns -1 with an exception set on failure. */
+static int LuaStateObject_checkin(LuaStateObject *self)
+{
+    PyObject *pool = self->pool;
+    PyObject *ret;
+
+    if (!pool)
+        return 0;
+    self->pool = NULL;
+    LuaStateObject_reset(self);
+    ret = PyObject_CallMethod(((LuaPool *)pool)->idle, "put", "O", self);
+    Py_DECREF(pool);
+    if (!ret)
+        return -1;
+    Py_DECREF(ret);
+    return 0;
+}
+
+/* A state checked out from a StatePool goes back to it at the end of
+ * the with block. */
+static PyObject *LuaStateObject_exit(LuaStateObject *self, PyObject *args)
+{
+    if (LuaStateObject_checkin(self) < 0)
+        return NULL;
+    Py_RETURN_FALSE;
+}
+
+/* The module functions that work on a state, run on this one instead of
+ * the default. */
+static PyMethodDef LuaStateObject_methods[] =
+{
+    {"execute",    Lua_execute,    METH_VARARGS,        NULL},
+    {"eval",       Lua_eval,       METH_VARARGS,        NULL},
+    {"globals",    Lua_globals,    METH_NOARGS,         NULL},
+    {"require",    Lua_require,    METH_VARARGS,        NULL},
+    {"map",        Lua_map,        METH_VARARGS,        NULL},
+    {"bind",       (PyCFunction)Lua_bind,
+                   METH_VARARGS | METH_KEYWORDS,        NULL},
+    {"table",      (PyCFunction)Lua_table,
+                   METH_VARARGS | METH_KEYWORDS,        NULL},
+    {"tracebacks", Lua_tracebacks, METH_VARARGS,        NULL},
+    {"string_mode", Lua_string_mode, METH_VARARGS,      NULL},
+    {"__enter__",  LuaStateObject_enter, METH_NOARGS,   NULL},
+    {"__exit__",   (PyCFunction)LuaStateObject_exit,
+                   METH_VARARGS,                        NULL},
+    {NULL,         NULL}
+};
+
+PyTypeObject LuaStateObject_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "lua.State",
+    .tp_basicsize = sizeof(LuaStateObject),
+    .tp_dealloc = (destructor)LuaStateObject_dealloc,
+    .tp_repr = (reprfunc)LuaStateObject_repr,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "independent lua interpreter state",
+    .tp_methods = LuaStateObject_methods,
+    .tp_new = LuaStateObject_new,
+    .tp_free = PyObject_Del,
+};
+
+static PyObject *LuaPool_new(PyTypeObject *type, PyObject *args,
+                             PyObject *kwargs)
+{
+    static char *kwlist[] = {"size", "init", NULL};
+    PyObject *init = Py_None;
+    PyObject *queue;
+    Py_ssize_t size, i;
+    LuaPool *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|O:StatePool", kwlist,
+                                     &size, &init))
+        return NULL;
+    if (size < 1) {
+        PyErr_SetString(PyExc_ValueError, "size must be positive");
+        return NULL;
+    }
+    if (init != Py_None && !PyUnicode_Check(init) && !PyCallable_Check(init)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "init must be Lua source or a callable");
+        return NULL;
+    }
+
+    self = (LuaPool *)type->tp_alloc(type, 0);
+    if (!self)
+        return NULL;
+    self->size = size;
+    queue = PyImport_ImportModule("queue");
+    if (queue) {
+        self->idle = PyObject_CallMethod(queue, "Queue", NULL);
+        Py_DECREF(queue);
+    }
+    if (!self->idle) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    for (i = 0; i != size; i++) {
+        PyObject *st = PyObject_CallObject((PyObject *)&LuaStateObject_Type,
+                                           NULL);
+        PyObject *ret = NULL;
+        if (!st) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        if (init == Py_None) {
+            Py_INCREF(Py_None);
+            ret = Py_None;
+        } else if (PyUnicode_Check(init)) {
+            ret = PyObject_CallMethod(st, "execute", "O", init);
+        } else {
+            ret = PyObject_CallFunctionObjArgs(init, st, NULL);
+        }
+        if (ret) {
+            Py_DECREF(ret);
+            LuaStateObject_snapshot((LuaStateObject *)st);
+            ret = PyObject_CallMethod(self->idle, "put", "O", st);
+        }
+        Py_DECREF(st);
+        if (!ret) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        Py_DECREF(ret);
+    }
+    return (PyObject *)self;
+}
+
+static void LuaPool_dealloc(LuaPool *self)
+{
+    Py_XDECREF(self->idle);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* Take an idle state, waiting up to timeout seconds (forever if None)
+ * for one to be handed back. */
+static PyObject *LuaPool_checkout(LuaPool *self, PyObject *args,
+                                  PyObject *kwargs)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject *timeout = Py_None;
+    PyObject *st;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:checkout", kwlist,
+                                     &timeout))
+        return NULL;
+    st = PyObject_CallMethod(self->idle, "get", "OO", Py_True, timeout);
+    if (!st)
+        return NULL;
+    Py_INCREF(self);
+    ((LuaStateObject *)st)->pool = (PyObject *)self;
+    return st;
+}
+
+static PyObject *LuaPool_repr(LuaPool *self)
+{
+    return PyUnicode_FromFormat("<Lua state pool of %zd>", self->size);
+}
+
+static PyMethodDef LuaPool_methods[] =
+{
+    {"checkout",   (PyCFunction)LuaPool_checkout,
+                   METH_VARARGS | METH_KEYWORDS,        NULL},
+    {NULL,         NULL}
+};
+
+static PyTypeObject LuaPool_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "lua.StatePool",
+    .tp_basicsize = sizeof(LuaPool),
+    .tp_dealloc = (destructor)LuaPool_dealloc,
+    .tp_repr = (reprfunc)LuaPool_repr,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "StatePool(size, init=None) -> pool of initialized lua states",
+    .tp_methods = LuaPool_methods,
+    .tp_new = LuaPool_new,
+    .tp_free = PyObject_Del,
+};
+
+/* lua.parallel_map: every worker thread runs the function in a state of
+ * its own.  Workers claim chunks of the input from a shared cursor, so
+ * the ones that get cheap items simply come back for more. */
+typedef struct
+{
+    PyObject *seq;      /* tuple of the items */
+    PyObject *ret;
+    Py_ssize_t next, n, chunk;
+    int running;
+    PyThread_type_lock done;
+    PyObject *exc_type, *exc_value, *exc_tb;
+} LuaParallel;
+
+typedef struct
+{
+    LuaParallel *job;
+    LuaStateObject *state;
+} LuaWorker;
+
+/* Call the function at 1 over a chunk: the arguments are laid out flat
+ * in the table at 2, nargs at 3 giving how many each call takes.  Runs
+ * without the GIL, as it touches nothing but Lua. */
+static int LuaParallel_run(lua_State *L)
+{
+    const int *nargs = (const int *)lua_touserdata(L, 3);
+    int n = (int)lua_tointeger(L, 4);
+    int i, j, k = 1;
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i != n; i++) {
+        luaL_checkstack(L, nargs[i] + 1, NULL);
+        lua_pushvalue(L, 1);
+        for (j = 0; j != nargs[i]; j++)
+            lua_rawgeti(L, 2, k++);
+        lua_call(L, nargs[i], 1);
+        lua_rawseti(L, 5, i + 1);
+    }
+    return 1;
+}
+
+/* Convert items lo..hi-1 in, run them, and convert the results back
+ * into their slots.  Tuples are unpacked into several arguments.  Needs
+ * the GIL, which is given up for the run itself. */
+static int LuaParallel_batch(LuaWorker *w, int *nargs,
+                             Py_ssize_t lo, Py_ssize_t hi)
+{
+    lua_State *L = w->state->L;
+    int base = lua_gettop(L);
+    Py_ssize_t i, j;
+    int k = 1;
+
+    LuaError_pushhandler(w->state);
+    lua_pushcfunction(L, LuaParallel_run);
+    lua_pushvalue(L, base);
+    lua_createtable(L, (int)(hi - lo), 0);
+    for (i = lo; i != hi; i++) {
+        PyObject *item = PyTuple_GET_ITEM(w->job->seq, i);
+        PyObject *const *args = &item;
+        Py_ssize_t n = 1;
+        if (PyTuple_Check(item)) {
+            args = PySequence_Fast_ITEMS(item);
+            n = PyTuple_GET_SIZE(item);
+        }
+        for (j = 0; j != n; j++) {
+            if (!py_convert(L, args[j])) {
+                if (!PyErr_Occurred())
+                    PyErr_Format(PyExc_TypeError,
+                                 "failed to convert item #%zd", i);
+                lua_settop(L, base);
+                return 0;
+            }
+            lua_rawseti(L, -2, k++);
+        }
+        nargs[i - lo] = (int)n;
+    }
+    lua_pushlightuserdata(L, nargs);
+    lua_pushinteger(L, (lua_Integer)(hi - lo));
+    if (Lua_pcall(w->state, 4, 1, base + 1) != 0) {
+        LuaRaise(w->state);
+        lua_settop(L, base);
+        return 0;
+    }
+
+    for (i = lo; i != hi; i++) {
+        PyObject *value;
+        lua_rawgeti(L, -1, (int)(i - lo + 1));
+        value = LuaConvert(L, -1);
+        lua_pop(L, 1);
+        if (!value) {
+            lua_settop(L, base);
+            return 0;
+        }
+        PyList_SET_ITEM(w->job->ret, i, value);
+    }
+    lua_settop(L, base);
+    return 1;
+}
+
+/* Take chunks until the input runs out or some worker fails.  The first
+ * failure is kept for the caller. */
+static void LuaParallel_work(LuaWorker *w)
+{
+    LuaParallel *job = w->job;
+    int *nargs = PyMem_New(int, job->chunk);
+
+    LuaState_lock(w->state);
+    while (!job->exc_type && job->next < job->n) {
+        Py_ssize_t lo = job->next;
+        Py_ssize_t hi = lo + job->chunk < job->n ? lo + job->chunk : job->n;
+        job->next = hi;
+        if (!nargs)
+            PyErr_NoMemory();
+        /* Ctrl-C stops the job between chunks. */
+        if (!nargs || PyErr_CheckSignals() < 0 ||
+            !LuaParallel_batch(w, nargs, lo, hi)) {
+            if (!job->exc_type)
+                PyErr_Fetch(&job->exc_type, &job->exc_value, &job->exc_tb);
+            else
+                PyErr_Clear();
+            break;
+        }
+    }
+    LuaState_unlock(w->state);
+    PyMem_Free(nargs);
+}
+
+static void LuaParallel_thread(void *arg)
+{
+    LuaWorker *w = (LuaWorker *)arg;
+    PyGILState_STATE gstate = PyGILState_Ensure();
+
+    LuaParallel_work(w);
+    if (--w->job->running == 0)
+        PyThread_release_lock(w->job->done);
+    PyGILState_Release(gstate);
+}
+
+/* Open a state for worker i of lua.parallel_map, or check one out of
+ * pool, and run source in it.  Past the first, a pool that has no idle
+ * state left gives NULL without an exception: the job then makes do
+ * with the workers it has. */
+static LuaStateObject *LuaParallel_state(PyObject *pool, Py_ssize_t i,
+                                         PyObject *source)
+{
+    PyObject *st, *ret;
+
+    if (pool == Py_None) {
+        st = PyObject_CallObject((PyObject *)&LuaStateObject_Type, NULL);
+    } else {
+        st = i ? PyObject_CallMethod(pool, "checkout", "i", 0)
+               : PyObject_CallMethod(pool, "checkout", NULL);
+        if (!st && i) {
+            PyObject *queue = PyImport_ImportModule("queue");
+            PyObject *empty = queue ? PyObject_GetAttrString(queue, "Empty")
+                                    : NULL;
+            if (empty && PyErr_ExceptionMatches(empty))
+                PyErr_Clear();
+            Py_XDECREF(empty);
+            Py_XDECREF(queue);
+        }
+    }
+    if (!st || source == Py_None)
+        return (LuaStateObject *)st;
+    ret = PyObject_CallMethod(st, "execute", "O", source);
+    if (!ret) {
+        PyObject *exc_type, *exc_value, *exc_tb;
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        if (LuaStateObject_checkin((LuaStateObject *)st) < 0)
+            PyErr_Clear();
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+        Py_DECREF(st);
+        return NULL;
+    }
+    Py_DECREF(ret);
+    return (LuaStateObject *)st;
+}
+
+/* lua.parallel_map(source, func_name, items, workers=None, chunk=256,
+ * pool=None) runs source in one state per worker, new ones or states
+ * checked out of pool, and calls the global func_name for every item,
+ * returning the results in input order. */
+static PyObject *Lua_parallel_map(PyObject *self, PyObject *args,
+                                  PyObject *kwargs)
+{
+    static char *kwlist[] = {"source", "func_name", "items", "workers",
+                             "chunk", "pool", NULL};
+    PyObject *source, *items, *nworkers = Py_None, *pool = Py_None;
+    PyObject *exc_type, *exc_value, *exc_tb;
+    const char *func_name;
+    Py_ssize_t workers, chunk = 256, i, nstates = 0;
+    LuaWorker *w = NULL;
+    LuaParallel job;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OsO|OnO:parallel_map",
+                                     kwlist, &source, &func_name, &items,
+                                     &nworkers, &chunk, &pool))
+        return NULL;
+    if (source != Py_None && !PyUnicode_Check(source)) {
+        PyErr_SetString(PyExc_TypeError, "source must be a str or None");
+        return NULL;
+    }
+    if (pool != Py_None && !PyObject_TypeCheck(pool, &LuaPool_Type)) {
+        PyErr_SetString(PyExc_TypeError, "pool must be a lua.StatePool");
+        return NULL;
+    }
+    if (chunk < 1) {
+        PyErr_SetString(PyExc_ValueError, "chunk must be positive");
+        return NULL;
+    }
+    if (nworkers == Py_None) {
+        PyObject *os = PyImport_ImportModule("os");
+        nworkers = os ? PyObject_CallMethod(os, "cpu_count", NULL) : NULL;
+        Py_XDECREF(os);
+        if (!nworkers)
+            return NULL;
+        workers = nworkers == Py_None ? 1 : PyLong_AsSsize_t(nworkers);
+        Py_DECREF(nworkers);
+    } else {
+        workers = PyLong_AsSsize_t(nworkers);
+    }
+    if (workers == -1 && PyErr_Occurred())
+        return NULL;
+    if (workers < 1) {
+        PyErr_SetString(PyExc_ValueError, "workers must be positive");
+        return NULL;
+    }
+    if (pool != Py_None && workers > ((LuaPool *)pool)->size)
+        workers = ((LuaPool *)pool)->size;
+
+    memset(&job, 0, sizeof(job));
+    /* A private copy: the GIL is given up for every batch, and the
+     * caller's list could change in the meantime. */
+    job.seq = PySequence_Tuple(items);
+    if (!job.seq)
+        return NULL;
+    job.n = PyTuple_GET_SIZE(job.seq);
+    /* A chunk never needs to be larger than the input. */
+    if (chunk > job.n)
+        chunk = job.n ? job.n : 1;
+    job.chunk = chunk;
+    job.ret = PyList_New(job.n);
+    if (!job.ret)
+        goto error;
+    /* No more workers than there are chunks to go round. */
+    if (workers > (job.n + chunk - 1) / chunk)
+        workers = job.n ? (job.n + chunk - 1) / chunk : 1;
+
+    w = PyMem_New(LuaWorker, workers);
+    if (!w) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (nstates = 0; nstates != workers; nstates++) {
+        LuaStateObject *state = LuaParallel_state(pool, nstates, source);
+        if (!state) {
+            if (PyErr_Occurred())
+                goto error;
+            break;
+        }
+        w[nstates].job = &job;
+        w[nstates].state = state;
+        /* The function stays at the bottom of the state's stack. */
+        lua_getglobal(state->L, func_name);
+        if (lua_isnil(state->L, -1)) {
+            PyErr_Format(PyExc_LookupError,
+                         "global '%s' is not defined", func_name);
+            nstates++;
+            goto error;
+        }
+    }
+    workers = nstates;
+
+    job.done = PyThread_allocate_lock();
+    if (!job.done) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    PyThread_acquire_lock(job.done, WAIT_LOCK);
+    job.running = (int)workers;
+    for (i = 1; i != workers; i++) {
+        if (PyThread_start_new_thread(LuaParallel_thread, &w[i]) ==
+            PYTHREAD_INVALID_THREAD_ID)
+            job.running--;
+    }
+    /* This thread is a worker too, and picks up whatever the others
+     * could not start on. */
+    LuaParallel_work(&w[0]);
+    if (--job.running != 0) {
+        PyLockStatus got;
+        /* Wait in short slices so that Ctrl-C still gets through: it
+         * stops the other workers once they finish their chunks. */
+        do {
+            Py_BEGIN_ALLOW_THREADS
+            got = PyThread_acquire_lock_timed(job.done, 50000, 0);
+            Py_END_ALLOW_THREADS
+            if (got != PY_LOCK_ACQUIRED && PyErr_CheckSignals() < 0) {
+                if (!job.exc_type)
+                    PyErr_Fetch(&job.exc_type, &job.exc_value,
+                                &job.exc_tb);
+                else
+                    PyErr_Clear();
+            }
+        } while (got != PY_LOCK_ACQUIRED);
+    }
+    PyThread_free_lock(job.done);
+
+    if (job.exc_type) {
+        PyErr_Restore(job.exc_type, job.exc_value, job.exc_tb);
+        Py_CLEAR(job.ret);
+    }
+    goto done;
+
+error:
+    Py_CLEAR(job.ret);
+done:
+    /* Pooled states go back with their globals as they were. */
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    for (i = 0; i != nstates; i++) {
+        lua_settop(w[i].state->L, 0);
+        if (LuaStateObject_checkin(w[i].state) < 0) {
+            if (!exc_type) {
+                PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+                Py_CLEAR(job.ret);
+            } else {
+                PyErr_Clear();
+            }
+        }
+        Py_DECREF(w[i].state);
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+    PyMem_Free(w);
+    Py_DECREF(job.seq);
+    return job.ret;
+}
+
+static PyMethodDef lua_methods[] =
+{
+    {"execute",    Lua_execute,    METH_VARARGS,        NULL},
+    {"eval",       Lua_eval,       METH_VARARGS,        NULL},
+    {"globals",    Lua_globals,    METH_NOARGS,         NULL},
+    {"require",    Lua_require,    METH_VARARGS,        NULL},
+    {"map",        Lua_map,        METH_VARARGS,        NULL},
+    {"bind",       (PyCFunction)Lua_bind,
+                   METH_VARARGS | METH_KEYWORDS,        NULL},
+    {"parallel_map", (PyCFunction)Lua_parallel_map,
+                   METH_VARARGS | METH_KEYWORDS,        NULL},
+    {"string_mode", Lua_string_mode, METH_VARARGS,      NULL},
+    {"tracebacks", Lua_tracebacks, METH_VARARGS,        NULL},
+    {"to_python",  (PyCFunction)Lua_to_python,
+                   METH_VARARGS | METH_KEYWORDS,        NULL},
+    {"table",      (PyCFunction)Lua_table,
+                   METH_VARARGS | METH_KEYWORDS,        NULL},
+    {"register_encoder", Lua_register_encoder, METH_VARARGS, NULL},
+    {"register_decoder", Lua_register_decoder, METH_VARARGS, NULL},
+    {NULL,         NULL}
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef lua_module =
+{
+    PyModuleDef_HEAD_INIT,
+    "lua",
+    "Lunatic-Python Python-Lua bridge",
+    -1,
+    lua_methods
+};
+#endif
+
+PyMODINIT_FUNC PyInit_lua(void)
+{
+  PyObject *m;
+  if (PyType_Ready(&LuaObject_Type) < 0 ||
+      PyType_Ready(&LuaString_Type) < 0 ||
+      PyType_Ready(&LuaBytes_Type) < 0 ||
+      PyType_Ready(&LuaArray_Type) < 0 ||
+      PyType_Ready(&LuaStream_Type) < 0 ||
+      PyType_Ready(&LuaStateObject_Type) < 0 ||
+      PyType_Ready(&LuaPool_Type) < 0 ||
+      (LuaError = PyErr_NewExceptionWithDoc("lua.LuaError",
+          "Error raised in Lua.  value is the raw error value and traceback\n"
+          "the Lua traceback, when lua.tracebacks() is on for the state.",
+          PyExc_RuntimeError, NULL)) == NULL ||
+#if PY_MAJOR_VERSION >= 3
       (m = PyModule_Create(&lua_module)) == NULL)
       return NULL;
 #else
@@ -580,13 +2944,37 @@ PyMODINIT_FUNC PyInit_lua(void)
       return;
 #endif
 
-    if (!LuaState)
-    {
-        LuaState = luaL_newstate();
-        luaL_openlibs(LuaState);
-        luaopen_python(LuaState);
-        lua_settop(LuaState, 0);
+    Py_INCREF(&LuaString_Type);
+    PyModule_AddObject(m, "LuaString", (PyObject *)&LuaString_Type);
+    Py_INCREF(&LuaBytes_Type);
+    PyModule_AddObject(m, "LuaBytes", (PyObject *)&LuaBytes_Type);
+    Py_INCREF(&LuaArray_Type);
+    PyModule_AddObject(m, "array", (PyObject *)&LuaArray_Type);
+    Py_INCREF(&LuaStream_Type);
+    PyModule_AddObject(m, "stream", (PyObject *)&LuaStream_Type);
+    Py_INCREF(&LuaStateObject_Type);
+    PyModule_AddObject(m, "State", (PyObject *)&LuaStateObject_Type);
+    Py_INCREF(&LuaPool_Type);
+    PyModule_AddObject(m, "StatePool", (PyObject *)&LuaPool_Type);
+    Py_INCREF(LuaError);
+    PyModule_AddObject(m, "LuaError", LuaError);
+
+    if (!LuaState) {
+        LuaState = Lua_open(NULL);
+        LuaDefaultState = LuaStateObject_For(LuaState);
+        /* Python is the host, so nothing else runs this state's Lua
+         * code behind our back. */
+        if (LuaDefaultState)
+            LuaDefaultState->nogil = 1;
+    } else {
+        LuaDefaultState = LuaStateObject_For(LuaState);
     }
+    if (!LuaDefaultState)
+#if PY_MAJOR_VERSION >= 3
+        return NULL;
+#else
+        return;
+#endif
 
 #if PY_MAJOR_VERSION >= 3
     return m;
@@ -25,27 +25,107 @@
 
 #if LUA_VERSION_NUM == 501
   #define luaL_len lua_objlen
+  #define lua_rawlen lua_objlen
   #define luaL_setfuncs(L, l, nup) luaL_register(L, NULL, (l))
   #ifdef luaL_newlib // defined in LuaJIT
     #undef luaL_newlib
   #endif
   #define luaL_newlib(L, l) (lua_newtable(L), luaL_register(L, NULL, (l)))
+  #ifndef lua_pushglobaltable
+    #define lua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+  #endif
 #endif
 
+/* A Lua interpreter state (lua.State).  Every LuaObject keeps a
+ * reference to the state its registry ref lives in; L is always the
+ * main thread.  owned states are closed with the object.  Python code
+ * holds lock, recursively per thread, while it uses the state, and
+ * nogil states run their Lua code with the GIL released.  A state a Lua
+ * host owns is only used from host, the thread that last entered
+ * Python from it. */
 typedef struct
 {
     PyObject_HEAD
+    lua_State *L;
+    int owned;
+    int nogil;
+    PyThread_type_lock lock;
+    unsigned long owner;
+    int depth;
+    unsigned long host;
+    int traceback;      /* LuaError records the Lua traceback */
+    int strmode;        /* LUA_STRMODE_* used by LuaConvert */
+    struct LuaStringCache *strcache;
+    PyObject *pool;     /* the StatePool it is checked out from */
+} LuaStateObject;
+
+extern PyTypeObject LuaStateObject_Type;
+
+#define LuaStateObject_Check(op) PyObject_TypeCheck(op, &LuaStateObject_Type)
+
+LuaStateObject* LuaStateObject_For(lua_State *L);
+
+typedef struct
+{
+    PyObject_HEAD
+    LuaStateObject *state;
     int ref;
     int refiter;
+    int nresults;
+#if PY_VERSION_HEX >= 0x03080000
+    vectorcallfunc vectorcall;
+#endif
 } LuaObject;
 
 extern PyTypeObject LuaObject_Type;
 
+#if PY_VERSION_HEX >= 0x03080000 && PY_VERSION_HEX < 0x03090000
+#define Py_TPFLAGS_HAVE_VECTORCALL _Py_TPFLAGS_HAVE_VECTORCALL
+#endif
+
 #define LuaObject_Check(op) PyObject_TypeCheck(op, &LuaObject_Type)
+#define LuaObject_L(op) (((LuaObject *)(op))->state->L)
+
+/* A Lua string handed to Python undecoded (see LUA_STRMODE_LAZY). The
+ * registry reference keeps s alive; value caches the decoded str.
+ * LuaBytes objects share this layout, leave value unused and cache
+ * their hash, -1 until computed. */
+typedef struct
+{
+    PyObject_HEAD
+    LuaStateObject *state;
+    int ref;
+    const char *s;
+    size_t len;
+    PyObject *value;
+    Py_hash_t hash;
+} LuaString;
+
+extern PyTypeObject LuaString_Type;
+
+#define LuaString_Check(op) PyObject_TypeCheck(op, &LuaString_Type)
+
+extern PyTypeObject LuaBytes_Type;
+
+#define LuaBytes_Check(op) PyObject_TypeCheck(op, &LuaBytes_Type)
+
+/* How LuaConvert returns Lua strings to Python. */
+enum
+{
+    LUA_STRMODE_STR,    /* str, or bytes when not valid UTF-8 */
+    LUA_STRMODE_BYTES,  /* always bytes */
+    LUA_STRMODE_LAZY,   /* LuaString, decoded on first use */
+    LUA_STRMODE_BUFFER, /* LuaBytes, a read-only buffer over the string */
+};
 
 PyObject* LuaConvert(lua_State *L, int n);
+int       LuaGIL_call(lua_State *L, lua_CFunction func);
+void      LuaGIL_wrap(lua_State *L);
+void      LuaGIL_setfuncs(lua_State *L, const luaL_Reg *l);
+PyObject* LuaConvertString(lua_State *L, int n, int mode);
 
 extern lua_State *LuaState;
+extern int LuaGILHost;
 
 #if PY_MAJOR_VERSION < 3
 #  define PyInit_lua initlua
@@ -22,6 +22,8 @@
 */
 
 #include <Python.h>
+#include <stdint.h>
+#include <string.h>
 #if defined(__linux__)
 #   include <dlfcn.h>
 #endif
@@ -34,9 +36,8 @@
 
 #include "pythoninlua.h"
 #include "luainpython.h"
+#include "luaarray.h"
 
-static int py_asfunc_call(lua_State *);
-static int py_eval(lua_State *);
 
 static int py_convert_custom(lua_State *L, PyObject *o, int asindx)
 {
@@ -53,192 +54,785 @@ static int py_convert_custom(lua_State *L, PyObject *o, int asindx)
     return 1;
 }
 
+/* Push a Python str as its UTF-8 encoding.  Compact ASCII strings are
+ * copied straight from their data, and other strings reuse the UTF-8
+ * buffer CPython caches on the object, so the only copy made is the one
+ * into the Lua string table. */
+static int py_convert_unicode(lua_State *L, PyObject *o)
+{
+    PyObject *bstr;
+    Py_ssize_t len;
+    char *s;
+
+#if PY_VERSION_HEX >= 0x03030000
+    const char *u;
+
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(o) < 0) {
+        PyErr_Clear();
+        return 0;
+    }
+#endif
+    if (PyUnicode_IS_COMPACT_ASCII(o)) {
+        lua_pushlstring(L, (const char *)PyUnicode_DATA(o),
+                        PyUnicode_GET_LENGTH(o));
+        return 1;
+    }
+
+    u = PyUnicode_AsUTF8AndSize(o, &len);
+    if (u) {
+        lua_pushlstring(L, u, len);
+        return 1;
+    }
+    PyErr_Clear();
+
+    /* Lone surrogates can't be cached as UTF-8; encode them anyway. */
+    bstr = PyUnicode_AsEncodedString(o, "utf-8", "surrogatepass");
+#else
+    bstr = PyUnicode_AsEncodedString(o, "utf-8", NULL);
+#endif
+    if (!bstr) {
+        PyErr_Clear();
+        return 0;
+    }
+    PyBytes_AsStringAndSize(bstr, &s, &len);
+    lua_pushlstring(L, s, len);
+    Py_DECREF(bstr);
+    return 1;
+}
+
+/* Push a Python int.  On Lua 5.3+ values that fit lua_Integer keep their
+ * integer subtype.  Bigger values degrade to a Lua float, and values that
+ * don't even fit a double are passed by reference as a Python object. */
+static int py_convert_long(lua_State *L, PyObject *o)
+{
+    double d;
+#if LUA_VERSION_NUM >= 503
+    int overflow;
+    long long v = PyLong_AsLongLongAndOverflow(o, &overflow);
+
+    if (!overflow && v >= LUA_MININTEGER && v <= LUA_MAXINTEGER) {
+        lua_pushinteger(L, (lua_Integer)v);
+        return 1;
+    }
+#endif
+    d = PyLong_AsDouble(o);
+    if (d == -1.0 && PyErr_Occurred()) {
+        PyErr_Clear();
+        return py_convert_custom(L, o, 0);
+    }
+    lua_pushnumber(L, (lua_Number)d);
+    return 1;
+}
+
+static int py_convert_bytes(lua_State *L, PyObject *o)
+{
+    Py_ssize_t len;
+    char *s;
+
+    PyBytes_AsStringAndSize(o, &s, &len);
+    lua_pushlstring(L, s, len);
+    return 1;
+}
+
+#if PY_MAJOR_VERSION < 3
+static int py_convert_int(lua_State *L, PyObject *o)
+{
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, (lua_Integer)PyInt_AsLong(o));
+#else
+    lua_pushnumber(L, (lua_Number)PyInt_AsLong(o));
+#endif
+    return 1;
+}
+#endif
+
+/* Encoders registered with lua.register_encoder(), keyed by type. */
+static PyObject *py_encoders = NULL;
+
+/* Convert whatever an encoder or __tolua__ returned.  Returning another
+ * instance of the same type would recurse forever, so that falls back to
+ * wrapping the original object. */
+static int py_convert_encoded(lua_State *L, PyObject *o, PyObject *value)
+{
+    int ret;
+    if (!value)
+        return 0;
+    if (Py_TYPE(value) == Py_TYPE(o))
+        ret = py_convert_custom(L, o, 0);
+    else
+        ret = py_convert(L, value);
+    Py_DECREF(value);
+    return ret;
+}
+
+enum
+{
+    PY_CONVERT_UNICODE,
+    PY_CONVERT_BYTES,
+    PY_CONVERT_INT,
+    PY_CONVERT_LONG,
+    PY_CONVERT_FLOAT,
+    PY_CONVERT_LUAOBJECT,
+    PY_CONVERT_LUASTRING,
+    PY_CONVERT_ARRAY,
+    PY_CONVERT_ENCODER,
+    PY_CONVERT_TOLUA,
+    PY_CONVERT_CONTAINER,
+    PY_CONVERT_OBJECT,
+};
+
+/* Dispatch table from Py_TYPE(o) to its conversion, filled on first use
+ * of each type.  Entries hold a reference to their type so a freed type's
+ * address can't be reused under a stale entry. */
+#define PY_CONVERT_SLOTS 256
+
+static struct
+{
+    PyTypeObject *type;
+    int kind;
+    PyObject *encoder;
+} py_converters[PY_CONVERT_SLOTS];
+
+static void py_convert_flush(void)
+{
+    int i;
+    for (i = 0; i != PY_CONVERT_SLOTS; i++) {
+        Py_CLEAR(py_converters[i].type);
+        Py_CLEAR(py_converters[i].encoder);
+    }
+}
+
+/* Work out the conversion for a type the slow way: user encoders along
+ * the MRO, then the __tolua__ protocol, then the built-in conversions. */
+static int py_convert_resolve(PyTypeObject *type, PyObject **encoder)
+{
+    *encoder = NULL;
+
+    if (py_encoders && type->tp_mro) {
+        Py_ssize_t i, n = PyTuple_GET_SIZE(type->tp_mro);
+        for (i = 0; i != n; i++) {
+            *encoder = PyDict_GetItem(py_encoders,
+                                      PyTuple_GET_ITEM(type->tp_mro, i));
+            if (*encoder)
+                return PY_CONVERT_ENCODER;
+        }
+    }
+    if (PyObject_HasAttrString((PyObject *)type, "__tolua__"))
+        return PY_CONVERT_TOLUA;
+
+    if (PyType_IsSubtype(type, &PyUnicode_Type))
+        return PY_CONVERT_UNICODE;
+    if (PyType_IsSubtype(type, &PyBytes_Type))
+        return PY_CONVERT_BYTES;
+#if PY_MAJOR_VERSION < 3
+    if (PyType_IsSubtype(type, &PyInt_Type))
+        return PY_CONVERT_INT;
+#endif
+    if (PyType_IsSubtype(type, &PyLong_Type))
+        return PY_CONVERT_LONG;
+    if (PyType_IsSubtype(type, &PyFloat_Type))
+        return PY_CONVERT_FLOAT;
+    if (PyType_IsSubtype(type, &LuaObject_Type))
+        return PY_CONVERT_LUAOBJECT;
+    if (PyType_IsSubtype(type, &LuaArray_Type))
+        return PY_CONVERT_ARRAY;
+    if (PyType_IsSubtype(type, &LuaString_Type) ||
+        PyType_IsSubtype(type, &LuaBytes_Type))
+        return PY_CONVERT_LUASTRING;
+    if (PyType_IsSubtype(type, &PyDict_Type) ||
+        PyType_IsSubtype(type, &PyList_Type) ||
+        PyType_IsSubtype(type, &PyTuple_Type))
+        return PY_CONVERT_CONTAINER;
+    return PY_CONVERT_OBJECT;
+}
+
+static int py_same_state(lua_State *L, LuaStateObject *state)
+{
+    return state->L == L || LuaStateObject_For(L) == state;
+}
+
+/* The dispatch table slot for type, resolved on first use. */
+static size_t py_convert_slot(PyTypeObject *type)
+{
+    size_t slot = ((uintptr_t)type >> 4) & (PY_CONVERT_SLOTS - 1);
+
+    if (py_converters[slot].type != type) {
+        PyObject *encoder;
+        int kind = py_convert_resolve(type, &encoder);
+        Py_XINCREF(encoder);
+        Py_XDECREF(py_converters[slot].encoder);
+        Py_INCREF(type);
+        Py_XDECREF(py_converters[slot].type);
+        py_converters[slot].type = type;
+        py_converters[slot].kind = kind;
+        py_converters[slot].encoder = encoder;
+    }
+    return slot;
+}
+
 int py_convert(lua_State *L, PyObject *o)
 {
-    int ret = 0;
+    size_t slot;
+
     if (o == Py_None)
     {
         /* Not really needed, but this way we may check
          * for errors with ret == 0. */
         lua_pushnil(L);
-        ret = 1;
+        return 1;
     } else if (o == Py_True) {
         lua_pushboolean(L, 1);
-        ret = 1;
+        return 1;
     } else if (o == Py_False) {
         lua_pushboolean(L, 0);
-        ret = 1;
-    } else if (PyUnicode_Check(o) || PyBytes_Check(o)) {
-        PyObject *bstr = PyUnicode_AsEncodedString(o, "utf-8", NULL);
-        Py_ssize_t len;
-        char *s;
+        return 1;
+    }
 
-        PyErr_Clear();
-        PyBytes_AsStringAndSize(bstr ? bstr : o, &s, &len);
-        lua_pushlstring(L, s, len);
-        if (bstr) Py_DECREF(bstr);
-        ret = 1;
+    slot = py_convert_slot(Py_TYPE(o));
+    switch (py_converters[slot].kind) {
+        case PY_CONVERT_UNICODE:
+            return py_convert_unicode(L, o);
+        case PY_CONVERT_BYTES:
+            return py_convert_bytes(L, o);
 #if PY_MAJOR_VERSION < 3
-    } else if (PyInt_Check(o)) {
-        lua_pushnumber(L, (lua_Number)PyInt_AsLong(o));
-        ret = 1;
+        case PY_CONVERT_INT:
+            return py_convert_int(L, o);
 #endif
-    } else if (PyLong_Check(o)) {
-        lua_pushnumber(L, (lua_Number)PyLong_AsLong(o));
-        ret = 1;
-    } else if (PyFloat_Check(o)) {
-        lua_pushnumber(L, (lua_Number)PyFloat_AsDouble(o));
-        ret = 1;
-    } else if (LuaObject_Check(o)) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)o)->ref);
-        ret = 1;
+        case PY_CONVERT_LONG:
+            return py_convert_long(L, o);
+        case PY_CONVERT_FLOAT:
+            lua_pushnumber(L, (lua_Number)PyFloat_AsDouble(o));
+            return 1;
+        case PY_CONVERT_LUAOBJECT:
+            /* Values of another state can only be reached through
+             * Python, so they cross over wrapped like any object. */
+            if (!py_same_state(L, ((LuaObject*)o)->state))
+                return py_convert_custom(L, o, 0);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)o)->ref);
+            return 1;
+        case PY_CONVERT_LUASTRING:
+            if (!py_same_state(L, ((LuaString*)o)->state)) {
+                lua_pushlstring(L, ((LuaString*)o)->s, ((LuaString*)o)->len);
+                return 1;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaString*)o)->ref);
+            return 1;
+        case PY_CONVERT_ARRAY:
+            return luaPy_push_array(L, o);
+        case PY_CONVERT_ENCODER: {
+            /* The encoder may register others and flush the table. */
+            PyObject *encoder = py_converters[slot].encoder;
+            PyObject *value;
+            Py_INCREF(encoder);
+            value = PyObject_CallFunctionObjArgs(encoder, o, NULL);
+            Py_DECREF(encoder);
+            return py_convert_encoded(L, o, value);
+        }
+        case PY_CONVERT_TOLUA:
+            return py_convert_encoded(L, o,
+                PyObject_CallMethod(o, "__tolua__", NULL));
+        case PY_CONVERT_CONTAINER:
+            return py_convert_custom(L, o, 1);
+        default:
+            return py_convert_custom(L, o, 0);
+    }
+}
+
+/* Register func as the encoder for type, or drop it when func is NULL. */
+int py_register_encoder(PyObject *type, PyObject *func)
+{
+    if (!py_encoders && !(py_encoders = PyDict_New()))
+        return -1;
+    if (func) {
+        if (PyDict_SetItem(py_encoders, type, func) < 0)
+            return -1;
+    } else if (PyDict_DelItem(py_encoders, type) < 0) {
+        if (!PyErr_ExceptionMatches(PyExc_KeyError))
+            return -1;
+        PyErr_Clear();
+    }
+    py_convert_flush();
+    return 0;
+}
+
+/* Push o as a native Lua table if it converts as a dict, list or tuple,
+ * recursing into nested containers while deep is set.  Containers
+ * already pushed are looked up in the memo table at index memo, which
+ * keeps shared and cyclic references intact.  Anything else, including
+ * containers with an encoder or __tolua__, goes through py_convert.
+ * Encoders run Python code that may change the container, so it is
+ * walked over a copy of its items.  Returns 1 on success, 0 when
+ * py_convert failed on o itself, or -1 with an error message pushed. */
+static int _py_convert_table(lua_State *L, PyObject *o, int deep,
+                             int memo, int level)
+{
+    PyObject *items;
+    Py_ssize_t i, n;
+    int rc;
+
+    if (py_converters[py_convert_slot(Py_TYPE(o))].kind !=
+        PY_CONVERT_CONTAINER)
+        return py_convert(L, o);
+
+    lua_pushlightuserdata(L, o);
+    lua_rawget(L, memo);
+    if (!lua_isnil(L, -1))
+        return 1;
+    lua_pop(L, 1);
+
+    if (level > Py_GetRecursionLimit() || !lua_checkstack(L, 4)) {
+        lua_pushliteral(L, "python container too deeply nested");
+        return -1;
+    }
+
+    items = PyDict_Check(o) ? PyDict_Items(o) : PySequence_Tuple(o);
+    if (!items) {
+        PyErr_Clear();
+        lua_pushliteral(L, "failed to read python container");
+        return -1;
+    }
+    n = PyDict_Check(o) ? PyList_GET_SIZE(items) : PyTuple_GET_SIZE(items);
+    lua_createtable(L, PyDict_Check(o) ? 0 : (int)n,
+                    PyDict_Check(o) ? (int)n : 0);
+    lua_pushlightuserdata(L, o);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, memo);
+
+    if (PyDict_Check(o)) {
+        for (i = 0; i != n; i++) {
+            PyObject *item = PyList_GET_ITEM(items, i);
+            if (!py_convert(L, PyTuple_GET_ITEM(item, 0))) {
+                lua_pushliteral(L, "failed to convert key");
+                goto error;
+            }
+            if (lua_isnil(L, -1)) {
+                lua_pushliteral(L, "table index is nil");
+                goto error;
+            }
+            rc = deep ? _py_convert_table(L, PyTuple_GET_ITEM(item, 1),
+                                          deep, memo, level+1)
+                      : py_convert(L, PyTuple_GET_ITEM(item, 1));
+            if (rc <= 0) {
+                if (rc == 0)
+                    lua_pushliteral(L, "failed to convert value");
+                goto error;
+            }
+            lua_rawset(L, -3);
+        }
     } else {
-        int asindx = PyDict_Check(o) || PyList_Check(o) || PyTuple_Check(o);
-        ret = py_convert_custom(L, o, asindx);
+        for (i = 0; i != n; i++) {
+            PyObject *item = PyTuple_GET_ITEM(items, i);
+            rc = deep ? _py_convert_table(L, item, deep, memo, level+1)
+                      : py_convert(L, item);
+            if (rc <= 0) {
+                if (rc == 0)
+                    lua_pushfstring(L, "failed to convert item #%d",
+                                    (int)i+1);
+                goto error;
+            }
+            lua_rawseti(L, -2, (int)i+1);
+        }
     }
+
+    Py_DECREF(items);
+    return 1;
+
+error:
+    Py_DECREF(items);
+    return -1;
+}
+
+int py_convert_table(lua_State *L, PyObject *o, int deep)
+{
+    int ret;
+    lua_newtable(L);
+    ret = _py_convert_table(L, o, deep, lua_gettop(L), 0);
+    if (ret < 0)
+        return luaL_error(L, "%s", lua_tostring(L, -1));
+    lua_remove(L, -2);
     return ret;
 }
 
-static int py_object_call(lua_State *L)
+#if PY_VERSION_HEX < 0x03090000
+#ifndef PY_VECTORCALL_ARGUMENTS_OFFSET
+#define PY_VECTORCALL_ARGUMENTS_OFFSET \
+    ((size_t)1 << (8 * sizeof(size_t) - 1))
+#endif
+/* Fallback for Pythons without a public vectorcall entry point. */
+static PyObject *PyObject_Vectorcall(PyObject *callable,
+                                     PyObject *const *args, size_t nargsf,
+                                     PyObject *kwnames)
 {
-    PyObject *args;
-    PyObject *value;
-    PyObject *pKywdArgs = NULL;
-    int nargs = lua_gettop(L)-1;
-    int ret = 0;
-    int i;
-    py_object *obj = (py_object*) luaL_checkudata(L, 1, POBJECT);
-    assert(obj);
+    Py_ssize_t i, n = (Py_ssize_t)(nargsf & ~PY_VECTORCALL_ARGUMENTS_OFFSET);
+    Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    PyObject *tuple, *dict = NULL, *ret = NULL;
+
+    tuple = PyTuple_New(n);
+    if (!tuple)
+        return NULL;
+    for (i = 0; i != n; i++) {
+        Py_INCREF(args[i]);
+        PyTuple_SET_ITEM(tuple, i, args[i]);
+    }
+    if (nkw && !(dict = PyDict_New()))
+        goto done;
+    for (i = 0; i != nkw; i++) {
+        if (PyDict_SetItem(dict, PyTuple_GET_ITEM(kwnames, i),
+                           args[n + i]) < 0)
+            goto done;
+    }
+    ret = PyObject_Call(callable, tuple, dict);
+done:
+    Py_DECREF(tuple);
+    Py_XDECREF(dict);
+    return ret;
+}
+#endif
 
-    if (!PyCallable_Check(obj->o))
-        return luaL_error(L, "object is not callable");
+/* Arguments being gathered for one vectorcall.  Slot 0 of args is left
+ * free so callees may use PY_VECTORCALL_ARGUMENTS_OFFSET; positional
+ * arguments follow, then keyword values, whose names go to names.  Small
+ * calls never touch the heap. */
+#define PY_CALL_SMALL 8
 
-    // passing a single table forces named keyword call style, e.g. plt.plot{x, y, c='red'}
-    if (nargs==1 && lua_istable(L, 2)) {
-        lua_pushnil(L);  /* first key */
-        nargs=0;
-        while (lua_next(L, 2) != 0) {
-            if (lua_isnumber(L, -2)) {
-                int i = lua_tointeger(L, -2);
-                nargs = i < nargs ? nargs : i;
-            }
-            lua_pop(L, 1);
+typedef struct
+{
+    PyObject **args;
+    PyObject **names;
+    Py_ssize_t n, nkw, cap;
+    PyObject *small[PY_CALL_SMALL + 1];
+    PyObject *smallnames[PY_CALL_SMALL];
+} py_callargs;
+
+static void py_callargs_init(py_callargs *a)
+{
+    a->args = a->small;
+    a->names = a->smallnames;
+    a->n = a->nkw = 0;
+    a->cap = PY_CALL_SMALL;
+}
+
+/* Make room for need arguments in total.  Returns 0 when out of memory. */
+static int py_callargs_reserve(py_callargs *a, Py_ssize_t need)
+{
+    PyObject **args, **names;
+    Py_ssize_t cap = a->cap;
+
+    if (need <= cap)
+        return 1;
+    while (cap < need)
+        cap *= 2;
+    args = PyMem_Malloc((cap + 1) * sizeof(PyObject *));
+    names = PyMem_Malloc(cap * sizeof(PyObject *));
+    if (!args || !names) {
+        PyMem_Free(args);
+        PyMem_Free(names);
+        return 0;
+    }
+    memcpy(args, a->args, (a->n + a->nkw + 1) * sizeof(PyObject *));
+    memcpy(names, a->names, a->nkw * sizeof(PyObject *));
+    if (a->args != a->small) {
+        PyMem_Free(a->args);
+        PyMem_Free(a->names);
+    }
+    a->args = args;
+    a->names = names;
+    a->cap = cap;
+    return 1;
+}
+
+static void py_callargs_clear(py_callargs *a)
+{
+    Py_ssize_t i;
+    for (i = 0; i != a->n + a->nkw; i++)
+        Py_DECREF(a->args[i + 1]);
+    for (i = 0; i != a->nkw; i++)
+        Py_DECREF(a->names[i]);
+    if (a->args != a->small) {
+        PyMem_Free(a->args);
+        PyMem_Free(a->names);
+    }
+    py_callargs_init(a);
+}
+
+/* Call o with the gathered arguments, consuming them. */
+static PyObject *py_callargs_call(py_callargs *a, PyObject *o)
+{
+    PyObject *kwnames = NULL, *ret;
+    Py_ssize_t i;
+
+    if (a->nkw) {
+        kwnames = PyTuple_New(a->nkw);
+        if (!kwnames) {
+            py_callargs_clear(a);
+            return NULL;
         }
-        args = PyTuple_New(nargs);
-        if (!args) {
-            PyErr_Print();
-            return luaL_error(L, "failed to create arguments tuple");
+        for (i = 0; i != a->nkw; i++) {
+            Py_INCREF(a->names[i]);
+            PyTuple_SET_ITEM(kwnames, i, a->names[i]);
         }
-        pKywdArgs = PyDict_New();    
-        if (!pKywdArgs) {
-            Py_DECREF(args);
-            PyErr_Print();
-            return luaL_error(L, "failed to create arguments dictionary");
+    }
+    ret = PyObject_Vectorcall(o, a->args + 1,
+                              (size_t)a->n | PY_VECTORCALL_ARGUMENTS_OFFSET,
+                              kwnames);
+    Py_XDECREF(kwnames);
+    py_callargs_clear(a);
+    return ret;
+}
+
+/* Gather the arguments of a call from Lua.  A single table argument
+ * selects the keyword call style, e.g. plt.plot{x, y, c='red'}: its
+ * sequence part is passed positionally and its string keys by name.
+ * Returns 0 on success, or -1 with an error message pushed. */
+static int py_callargs_gather(lua_State *L, py_callargs *a, int base)
+{
+    int top = lua_gettop(L);
+    Py_ssize_t i, n;
+
+    if (top == base && lua_istable(L, base)) {
+        n = (Py_ssize_t)lua_rawlen(L, base);
+        if (!py_callargs_reserve(a, n)) {
+            lua_pushliteral(L, "failed to allocate arguments");
+            return -1;
         }
-        lua_pushnil(L);  /* first key */
-        while (lua_next(L, 2) != 0) {
-            if (lua_isnumber(L, -2)) {
-                PyObject *arg = LuaConvert(L, -1);
-                if (!arg) {
-                    Py_DECREF(args);
-                    Py_DECREF(pKywdArgs);
-                    return luaL_error(L, "failed to convert argument #%d", lua_tointeger(L, -2));
-                }
-                PyTuple_SetItem(args, lua_tointeger(L, -2)-1, arg);
+        for (i = 0; i != n; i++) {
+            PyObject *arg;
+            lua_rawgeti(L, base, (int)i+1);
+            arg = LuaConvert(L, -1);
+            lua_pop(L, 1);
+            if (!arg) {
+                lua_pushfstring(L, "failed to convert argument #%d",
+                                (int)i+1);
+                return -1;
             }
-            else if (lua_isstring(L, -2)) {
-                PyObject *arg = LuaConvert(L, -1);
-                if (!arg) {
-                    Py_DECREF(args);
-                    Py_DECREF(pKywdArgs);
-                    return luaL_error(L, "failed to convert argument '%s'", lua_tostring(L, -2));
+            a->args[++a->n] = arg;
+        }
+        lua_pushnil(L);
+        while (lua_next(L, base) != 0) {
+            PyObject *name, *arg;
+            if (lua_type(L, -2) == LUA_TNUMBER) {
+                lua_Number k = lua_tonumber(L, -2);
+                if (k >= 1 && k <= (lua_Number)n && k == (lua_Number)(int)k) {
+                    lua_pop(L, 1);
+                    continue;
                 }
-                PyDict_SetItemString(pKywdArgs, lua_tostring(L, -2), arg);
-                Py_DECREF(arg);
             }
+            if (lua_type(L, -2) != LUA_TSTRING) {
+                lua_pop(L, 2);
+                lua_pushliteral(L, "keyword argument names must be strings");
+                return -1;
+            }
+            if (!py_callargs_reserve(a, a->n + a->nkw + 1)) {
+                lua_pop(L, 2);
+                lua_pushliteral(L, "failed to allocate arguments");
+                return -1;
+            }
+            name = LuaConvertString(L, -2, LUA_STRMODE_STR);
+            arg = name ? LuaConvert(L, -1) : NULL;
             lua_pop(L, 1);
+            if (!arg || !PyUnicode_Check(name)) {
+                Py_XDECREF(name);
+                Py_XDECREF(arg);
+                lua_pushfstring(L, "failed to convert argument '%s'",
+                                lua_tostring(L, -1));
+                return -1;
+            }
+            a->names[a->nkw] = name;
+            a->args[1 + a->n + a->nkw++] = arg;
         }
+        return 0;
     }
-    // regular call style e.g. plt.plot(x, y)
-    else {
-        args = PyTuple_New(nargs);
-        if (!args) {
-            PyErr_Print();
-            return luaL_error(L, "failed to create arguments tuple");
+
+    n = top - base + 1;
+    if (!py_callargs_reserve(a, n)) {
+        lua_pushliteral(L, "failed to allocate arguments");
+        return -1;
+    }
+    for (i = 0; i != n; i++) {
+        PyObject *arg = LuaConvert(L, base + (int)i);
+        if (!arg) {
+            lua_pushfstring(L, "failed to convert argument #%d", (int)i+1);
+            return -1;
         }
-        for (i = 0; i != nargs; i++) {
-            PyObject *arg = LuaConvert(L, i+2);
-            if (!arg) {
-                Py_DECREF(args);
-                return luaL_error(L, "failed to convert argument #%d", i+1);
-            }
-            PyTuple_SetItem(args, i, arg);
-       }
+        a->args[++a->n] = arg;
     }
+    return 0;
+}
 
-    value = PyObject_Call(obj->o, args, pKywdArgs);
-    Py_DECREF(args);
-    if (pKywdArgs) Py_DECREF(pKywdArgs);
+/* Raise the pending Python exception as a Lua error.  The error value
+ * is a PEXCEPTION userdata holding the exception itself, which is only
+ * formatted if something calls tostring on it. */
+static int py_call_error(lua_State *L)
+{
+    PyObject *exc_type, *exc_value, *exc_traceback;
+    PyObject **ud;
 
-    if (value) {
-        ret = py_convert(L, value);
-        Py_DECREF(value);
-    } else {
-        char s_exc[1024] = {0};
-        char s_traceback[1024] = {0};
-
-        PyObject *exc_type, *exc_value, *exc_traceback;
-        PyErr_Fetch(&exc_type, &exc_value, &exc_traceback);
-        PyErr_NormalizeException(&exc_type, &exc_value, &exc_traceback);
-
-        PyObject *exc_str = PyObject_Str(exc_value);
-
-        // Need not be garbage collected as per documentation of PyUnicode_AsUTF8
-        const char *exc_cstr = (exc_str)?PyUnicode_AsUTF8(exc_str):"";
-        strncpy(s_exc, (!(exc_cstr)?"UNKNOWN ERROR\n":exc_cstr), 1023);
-
-        if (exc_value != NULL && exc_traceback != NULL) {
-            PyObject *traceback_module = PyImport_ImportModule("traceback");
-            if (traceback_module != NULL) {
-                PyObject *traceback_list = PyObject_CallMethod(traceback_module,
-                        "format_exception", "OOO", exc_type, exc_value, exc_traceback);
-                if (traceback_list != NULL) {
-                    PyObject *traceback_str = PyUnicode_Join(PyUnicode_FromString(""), traceback_list);
-                    if (traceback_str != NULL) {
-                        // Need not be garbage collected as per documentation of PyUnicode_AsUTF8
-                        const char *traceback_cstr = PyUnicode_AsUTF8(traceback_str);
-                        if (traceback_cstr != NULL) {
-                            strncpy(s_traceback, traceback_cstr, 1023);
-                        }
-                        Py_XDECREF(traceback_str);
-                    }
-                    Py_XDECREF(traceback_list);
-                }
-                Py_XDECREF(traceback_module);
-            }
-        }
+    PyErr_Fetch(&exc_type, &exc_value, &exc_traceback);
+    PyErr_NormalizeException(&exc_type, &exc_value, &exc_traceback);
+    if (!exc_value) {
         Py_XDECREF(exc_type);
-        Py_XDECREF(exc_value);
         Py_XDECREF(exc_traceback);
-        Py_XDECREF(exc_str);
+        return luaL_error(L, "error calling python function:\n"
+                             "Exception: UNKNOWN ERROR\n");
+    }
+    if (exc_traceback)
+        PyException_SetTraceback(exc_value, exc_traceback);
+    Py_XDECREF(exc_type);
+    Py_XDECREF(exc_traceback);
+
+    ud = (PyObject **) lua_newuserdata(L, sizeof(PyObject *));
+    *ud = exc_value;
+    luaL_getmetatable(L, PEXCEPTION);
+    lua_setmetatable(L, -2);
+    return lua_error(L);
+}
+
+PyObject* luaPy_to_pexception(lua_State *L, int n)
+{
+    if(!lua_getmetatable(L, n)) return NULL;
+    luaL_getmetatable(L, PEXCEPTION);
+    int is_pexception = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
 
-        if (*s_traceback == '\0') {
-            luaL_error(L, "error calling python function:\nException: %s", s_exc);
+    return is_pexception ? *(PyObject **) lua_touserdata(L, n) : NULL;
+}
+
+static int py_exception_gc(lua_State *L)
+{
+    PyObject **ud = (PyObject **) luaL_checkudata(L, 1, PEXCEPTION);
+    Py_CLEAR(*ud);
+    return 0;
+}
+
+/* Same text the error used to carry: the full formatted traceback, or
+ * just str(exc) when there is none. */
+static int py_exception_tostring(lua_State *L)
+{
+    PyObject *exc = *(PyObject **) luaL_checkudata(L, 1, PEXCEPTION);
+    PyObject *tb = PyException_GetTraceback(exc);
+    PyObject *text = NULL;
+
+    if (tb) {
+        PyObject *traceback_module = PyImport_ImportModule("traceback");
+        if (traceback_module) {
+            PyObject *traceback_list = PyObject_CallMethod(traceback_module,
+                    "format_exception", "OOO", Py_TYPE(exc), exc, tb);
+            if (traceback_list) {
+                PyObject *sep = PyUnicode_FromString("");
+                if (sep)
+                    text = PyUnicode_Join(sep, traceback_list);
+                Py_XDECREF(sep);
+                Py_DECREF(traceback_list);
+            }
+            Py_DECREF(traceback_module);
         }
-        else {
-            luaL_error(L, "error calling python function:\nException: %s", s_traceback);
+        Py_DECREF(tb);
+        PyErr_Clear();
+    }
+    if (!text)
+        text = PyObject_Str(exc);
+
+    const char *s = text ? PyUnicode_AsUTF8(text) : NULL;
+    if (!s) {
+        PyErr_Clear();
+        s = "UNKNOWN ERROR\n";
+    }
+    lua_pushfstring(L, "error calling python function:\nException: %s", s);
+    Py_XDECREF(text);
+    return 1;
+}
+
+/* err.type is the exception class name, err.message is str(exc) and
+ * err.value the exception object itself, all without formatting the
+ * traceback. */
+static int py_exception_index(lua_State *L)
+{
+    PyObject *exc = *(PyObject **) luaL_checkudata(L, 1, PEXCEPTION);
+    const char *key = luaL_checkstring(L, 2);
+
+    if (strcmp(key, "type") == 0) {
+        const char *name = Py_TYPE(exc)->tp_name;
+        const char *dot = strrchr(name, '.');
+        lua_pushstring(L, dot ? dot + 1 : name);
+    } else if (strcmp(key, "value") == 0) {
+        return py_convert_custom(L, exc, 0);
+    } else if (strcmp(key, "message") == 0) {
+        PyObject *str = PyObject_Str(exc);
+        const char *s = str ? PyUnicode_AsUTF8(str) : NULL;
+        if (!s) {
+            Py_XDECREF(str);
+            PyErr_Print();
+            return luaL_error(L, "failed to format exception");
         }
+        lua_pushstring(L, s);
+        Py_DECREF(str);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+make_pyentry(py_exception_gc);
+make_pyentry(py_exception_tostring);
+make_pyentry(py_exception_index);
+
+static const luaL_Reg py_exception_mt[] =
+{
+    {"__gc",       py_exception_gc_entry},
+    {"__tostring", py_exception_tostring_entry},
+    {"__index",    py_exception_index_entry},
+    {NULL, NULL}
+};
+
+static int py_object_call(lua_State *L)
+{
+    py_callargs a;
+    PyObject *value;
+    int ret = 0;
+    py_object *obj = (py_object*) luaL_checkudata(L, 1, POBJECT);
+    assert(obj);
 
+    if (!PyCallable_Check(obj->o))
+        return luaL_error(L, "object is not callable");
+
+    py_callargs_init(&a);
+    if (py_callargs_gather(L, &a, 2) < 0) {
+        py_callargs_clear(&a);
+        PyErr_Clear();
+        return lua_error(L);
+    }
+
+    value = py_callargs_call(&a, obj->o);
+
+    if (value) {
+        ret = py_convert(L, value);
+        Py_DECREF(value);
+        if (!ret && PyErr_Occurred()) {
+            PyErr_Print();
+            return luaL_error(L, "failed to convert return value");
+        }
+    } else {
+        return py_call_error(L);
     }
 
     return ret;
 }
 
+/* Python containers are keyed by str, so string keys are always decoded
+ * eagerly, whatever the configured string mode. */
+static PyObject *_p_object_key(lua_State *L, int keyn)
+{
+    if (lua_type(L, keyn) == LUA_TSTRING)
+        return LuaConvertString(L, keyn, LUA_STRMODE_STR);
+    return LuaConvert(L, keyn);
+}
+
 static int _p_object_newindex_set(lua_State *L, py_object *obj,
                   int keyn, int valuen)
 {
     PyObject *value;
-    PyObject *key = LuaConvert(L, keyn);
+    PyObject *key = _p_object_key(L, keyn);
 
     if (!key) {
         return luaL_argerror(L, 1, "failed to convert key");
@@ -277,6 +871,8 @@ static int py_object_newindex_set(lua_State *L)
     return _p_object_newindex_set(L, obj, 1, 2);
 }
 
+make_pyentry(py_object_newindex_set);
+
 static int py_object_newindex(lua_State *L)
 {
     PyObject *value;
@@ -307,7 +903,7 @@ static int py_object_newindex(lua_State *L)
 
 static int _p_object_index_get(lua_State *L, py_object *obj, int keyn)
 {
-    PyObject *key = LuaConvert(L, keyn);
+    PyObject *key = _p_object_key(L, keyn);
     PyObject *item;
     int ret = 0;
 
@@ -346,6 +942,8 @@ static int py_object_index_get(lua_State *L)
     return _p_object_index_get(L, obj, 1);
 }
 
+make_pyentry(py_object_index_get);
+
 static int py_object_index(lua_State *L)
 {
     int ret = 0;
@@ -362,11 +960,13 @@ static int py_object_index(lua_State *L)
 
     if (strcmp(attr, "__get") == 0) {
         lua_pushvalue(L, 1);
-        lua_pushcclosure(L, py_object_index_get, 1);
+        lua_pushcclosure(L, py_object_index_get_entry, 1);
+        LuaGIL_wrap(L);
         return 1;
     } else if (strcmp(attr, "__set") == 0) {
         lua_pushvalue(L, 1);
-        lua_pushcclosure(L, py_object_newindex_set, 1);
+        lua_pushcclosure(L, py_object_newindex_set_entry, 1);
+        LuaGIL_wrap(L);
         return 1;
     }
 
@@ -415,48 +1015,210 @@ static int py_object_tostring(lua_State *L)
     return 1;
 }
 
-static int py_operator_lambda(lua_State *L,  const char *op)
+/* Push the result of a Python operation, or raise its exception. */
+static int py_object_result(lua_State *L, PyObject *value)
+{
+    int ret;
+
+    if (!value)
+        return py_call_error(L);
+    ret = py_convert(L, value);
+    Py_DECREF(value);
+    if (!ret) {
+        PyErr_Print();
+        return luaL_error(L, "failed to convert return value");
+    }
+    return ret;
+}
+
+/* Metamethods get both operands, only one of which need be a Python
+ * object; the other converts the usual way. */
+static int py_object_binop(lua_State *L, binaryfunc op)
+{
+    PyObject *a, *b, *value;
+
+    a = LuaConvert(L, 1);
+    b = a ? LuaConvert(L, 2) : NULL;
+    if (!b) {
+        Py_XDECREF(a);
+        PyErr_Clear();
+        return luaL_error(L, "failed to convert operand");
+    }
+    value = op(a, b);
+    Py_DECREF(a);
+    Py_DECREF(b);
+    return py_object_result(L, value);
+}
+
+static int py_object_unop(lua_State *L, unaryfunc op)
+{
+    py_object *obj = (py_object*) luaL_checkudata(L, 1, POBJECT);
+    return py_object_result(L, op(obj->o));
+}
+
+static int py_object_compare(lua_State *L, int op)
 {
-  static char script_buff[] = "lambda a, b: a    b";
-  static size_t len = sizeof(script_buff) / sizeof(script_buff[0]);
-  snprintf(script_buff, len, "lambda a, b: a %s b", op);
+    PyObject *a, *b;
+    int ret;
+
+    a = LuaConvert(L, 1);
+    b = a ? LuaConvert(L, 2) : NULL;
+    if (!b) {
+        Py_XDECREF(a);
+        PyErr_Clear();
+        return luaL_error(L, "failed to convert operand");
+    }
+    ret = PyObject_RichCompareBool(a, b, op);
+    Py_DECREF(a);
+    Py_DECREF(b);
+    if (ret < 0)
+        return py_call_error(L);
+    lua_pushboolean(L, ret);
+    return 1;
+}
 
-  lua_pushcfunction(L, py_eval);
-  lua_pushlstring(L, script_buff, len);
-  lua_call(L, 1, 1);
-  return luaL_ref(L, LUA_REGISTRYINDEX);
+static PyObject *py_number_power(PyObject *a, PyObject *b)
+{
+    return PyNumber_Power(a, b, Py_None);
 }
 
-#define make_pyoperator(opname, opliteral) \
+#define make_pyoperator(opname, func) \
   static int py_object_ ## opname(lua_State *L) \
   { \
-    static int op_ref = LUA_REFNIL; \
-    if (op_ref == LUA_REFNIL) op_ref = py_operator_lambda(L, opliteral); \
-    \
-    lua_rawgeti(L, LUA_REGISTRYINDEX, op_ref); \
-    lua_insert(L, 1); \
-    return py_object_call(L); \
+    return py_object_binop(L, func); \
   } \
   struct opname ## __LINE__ // force semi
 
-make_pyoperator(_pow, "**");
-make_pyoperator(_mul, "*");
-make_pyoperator(_div, "/");
-make_pyoperator(_add, "+");
-make_pyoperator(_sub, "-");
+make_pyoperator(_pow, py_number_power);
+make_pyoperator(_mul, PyNumber_Multiply);
+make_pyoperator(_div, PyNumber_TrueDivide);
+make_pyoperator(_add, PyNumber_Add);
+make_pyoperator(_sub, PyNumber_Subtract);
+make_pyoperator(_mod, PyNumber_Remainder);
+make_pyoperator(_idiv, PyNumber_FloorDivide);
+make_pyoperator(_band, PyNumber_And);
+make_pyoperator(_bor, PyNumber_Or);
+make_pyoperator(_bxor, PyNumber_Xor);
+make_pyoperator(_shl, PyNumber_Lshift);
+make_pyoperator(_shr, PyNumber_Rshift);
+
+static int py_object__unm(lua_State *L)
+{
+    return py_object_unop(L, PyNumber_Negative);
+}
+
+static int py_object__bnot(lua_State *L)
+{
+    return py_object_unop(L, PyNumber_Invert);
+}
+
+static int py_object__eq(lua_State *L)
+{
+    return py_object_compare(L, Py_EQ);
+}
+
+static int py_object__lt(lua_State *L)
+{
+    return py_object_compare(L, Py_LT);
+}
+
+static int py_object__le(lua_State *L)
+{
+    return py_object_compare(L, Py_LE);
+}
+
+static int py_object__len(lua_State *L)
+{
+    py_object *obj = (py_object*) luaL_checkudata(L, 1, POBJECT);
+    Py_ssize_t len = PyObject_Size(obj->o);
+
+    if (len < 0)
+        return py_call_error(L);
+    lua_pushinteger(L, len);
+    return 1;
+}
+
+/* .. joins the string forms of both operands, as it would for Lua
+ * values: str() for Python objects, numbers and strings as they are. */
+static int py_object__concat(lua_State *L)
+{
+    int i;
+
+    for (i = 1; i <= 2; i++) {
+        py_object *obj = luaPy_to_pobject(L, i);
+        if (obj) {
+            PyObject *str = PyObject_Str(obj->o);
+            Py_ssize_t len;
+            const char *s = str ? PyUnicode_AsUTF8AndSize(str, &len) : NULL;
+            if (!s) {
+                Py_XDECREF(str);
+                return py_call_error(L);
+            }
+            lua_pushlstring(L, s, len);
+            Py_DECREF(str);
+        } else if (lua_type(L, i) == LUA_TSTRING ||
+                   lua_type(L, i) == LUA_TNUMBER) {
+            lua_pushvalue(L, i);
+        } else {
+            return luaL_error(L, "attempt to concatenate a %s value",
+                              luaL_typename(L, i));
+        }
+    }
+    lua_concat(L, 2);
+    return 1;
+}
+
+make_pyentry(py_object_call);
+make_pyentry(py_object_index);
+make_pyentry(py_object_newindex);
+make_pyentry(py_object_gc);
+make_pyentry(py_object_tostring);
+make_pyentry(py_object__pow);
+make_pyentry(py_object__mul);
+make_pyentry(py_object__div);
+make_pyentry(py_object__add);
+make_pyentry(py_object__sub);
+make_pyentry(py_object__mod);
+make_pyentry(py_object__idiv);
+make_pyentry(py_object__band);
+make_pyentry(py_object__bor);
+make_pyentry(py_object__bxor);
+make_pyentry(py_object__shl);
+make_pyentry(py_object__shr);
+make_pyentry(py_object__unm);
+make_pyentry(py_object__bnot);
+make_pyentry(py_object__eq);
+make_pyentry(py_object__lt);
+make_pyentry(py_object__le);
+make_pyentry(py_object__len);
+make_pyentry(py_object__concat);
 
 static const luaL_Reg py_object_mt[] =
 {
-    {"__call",  py_object_call},
-    {"__index", py_object_index},
-    {"__newindex",  py_object_newindex},
-    {"__gc",    py_object_gc},
-    {"__tostring",  py_object_tostring},
-    {"__pow",   py_object__pow},
-    {"__mul",   py_object__mul},
-    {"__div",   py_object__div},
-    {"__add",   py_object__add},
-    {"__sub",   py_object__sub},
+    {"__call",  py_object_call_entry},
+    {"__index", py_object_index_entry},
+    {"__newindex",  py_object_newindex_entry},
+    {"__gc",    py_object_gc_entry},
+    {"__tostring",  py_object_tostring_entry},
+    {"__pow",   py_object__pow_entry},
+    {"__mul",   py_object__mul_entry},
+    {"__div",   py_object__div_entry},
+    {"__add",   py_object__add_entry},
+    {"__sub",   py_object__sub_entry},
+    {"__mod",   py_object__mod_entry},
+    {"__idiv",  py_object__idiv_entry},
+    {"__band",  py_object__band_entry},
+    {"__bor",   py_object__bor_entry},
+    {"__bxor",  py_object__bxor_entry},
+    {"__shl",   py_object__shl_entry},
+    {"__shr",   py_object__shr_entry},
+    {"__unm",   py_object__unm_entry},
+    {"__bnot",  py_object__bnot_entry},
+    {"__eq",    py_object__eq_entry},
+    {"__lt",    py_object__lt_entry},
+    {"__le",    py_object__le_entry},
+    {"__len",   py_object__len_entry},
+    {"__concat",    py_object__concat_entry},
     {NULL, NULL}
 };
 
@@ -536,6 +1298,8 @@ static int py_asfunc_call(lua_State *L)
     return py_object_call(L);
 }
 
+make_pyentry(py_asfunc_call);
+
 static int py_asfunc(lua_State *L)
 {
     py_object *obj = luaL_checkudata(L, 1, POBJECT);
@@ -543,7 +1307,8 @@ static int py_asfunc(lua_State *L)
         return luaL_error(L, "object is not callable");
 
     lua_settop(L, 1);
-    lua_pushcclosure(L, py_asfunc_call, 1);
+    lua_pushcclosure(L, py_asfunc_call_entry, 1);
+    LuaGIL_wrap(L);
 
     return 1;
 }
@@ -622,6 +1387,332 @@ static int py_import(lua_State *L)
     return ret;
 }
 
+static py_buffer *py_buffer_check(lua_State *L, int n)
+{
+    py_buffer *buf = (py_buffer*) luaL_checkudata(L, n, PBUFFER);
+    if (buf->released)
+        luaL_error(L, "python buffer already released");
+    return buf;
+}
+
+/* Translate a 1-based Lua index into a 0-based element offset, or -1. */
+static Py_ssize_t py_buffer_offset(lua_State *L, py_buffer *buf, int n)
+{
+    lua_Number i;
+    if (lua_type(L, n) != LUA_TNUMBER)
+        return -1;
+    i = lua_tonumber(L, n);
+    if (i < 1 || i > (lua_Number)buf->n || i != (lua_Number)(Py_ssize_t)i)
+        return -1;
+    return (Py_ssize_t)i - 1;
+}
+
+#define py_buffer_get(T, push) \
+    { T v; memcpy(&v, p, sizeof(v)); push(L, v); break; }
+#define py_buffer_set(T, check) \
+    { T v = (T)check(L, 3); memcpy(p, &v, sizeof(v)); break; }
+
+#if LUA_VERSION_NUM >= 503
+#  define py_buffer_checkinteger luaL_checkinteger
+#else
+#  define py_buffer_checkinteger luaL_checknumber
+#endif
+
+/* Unsigned 64-bit elements past the largest Lua integer come back as
+ * floats rather than wrapping around to negative values. */
+static void py_buffer_pushunsigned(lua_State *L, unsigned long long v)
+{
+#if LUA_VERSION_NUM >= 503
+    if (v <= (unsigned long long)LUA_MAXINTEGER) {
+        lua_pushinteger(L, (lua_Integer)v);
+        return;
+    }
+#endif
+    lua_pushnumber(L, (lua_Number)v);
+}
+
+static int py_buffer_index(lua_State *L)
+{
+    py_buffer *buf = py_buffer_check(L, 1);
+    Py_ssize_t i = py_buffer_offset(L, buf, 2);
+    const char *p;
+
+    if (i < 0) {
+        /* Not an element: look it up in the methods table. */
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        return 1;
+    }
+
+    p = (const char *)buf->view.buf + i * buf->view.itemsize;
+    switch (buf->fmt) {
+        case 'c': lua_pushlstring(L, p, 1); break;
+        case '?': py_buffer_get(unsigned char, lua_pushboolean)
+        case 'b': py_buffer_get(signed char, lua_pushinteger)
+        case 'B': py_buffer_get(unsigned char, lua_pushinteger)
+        case 'h': py_buffer_get(short, lua_pushinteger)
+        case 'H': py_buffer_get(unsigned short, lua_pushinteger)
+        case 'i': py_buffer_get(int, lua_pushinteger)
+        case 'I': py_buffer_get(unsigned int, lua_pushinteger)
+        case 'l': py_buffer_get(long, lua_pushinteger)
+        case 'L': py_buffer_get(unsigned long, py_buffer_pushunsigned)
+        case 'q': py_buffer_get(long long, lua_pushinteger)
+        case 'Q': py_buffer_get(unsigned long long, py_buffer_pushunsigned)
+        case 'f': py_buffer_get(float, lua_pushnumber)
+        case 'd': py_buffer_get(double, lua_pushnumber)
+    }
+    return 1;
+}
+
+static int py_buffer_newindex(lua_State *L)
+{
+    py_buffer *buf = py_buffer_check(L, 1);
+    Py_ssize_t i = py_buffer_offset(L, buf, 2);
+    char *p;
+
+    if (buf->view.readonly)
+        return luaL_error(L, "python buffer is read-only");
+    if (i < 0)
+        return luaL_error(L, "python buffer index out of range");
+
+    p = (char *)buf->view.buf + i * buf->view.itemsize;
+    switch (buf->fmt) {
+        case 'c': {
+            size_t len;
+            const char *s = luaL_checklstring(L, 3, &len);
+            luaL_argcheck(L, len == 1, 3, "single character expected");
+            *p = *s;
+            break;
+        }
+        case '?': *p = (char)lua_toboolean(L, 3); break;
+        case 'b': py_buffer_set(signed char, py_buffer_checkinteger)
+        case 'B': py_buffer_set(unsigned char, py_buffer_checkinteger)
+        case 'h': py_buffer_set(short, py_buffer_checkinteger)
+        case 'H': py_buffer_set(unsigned short, py_buffer_checkinteger)
+        case 'i': py_buffer_set(int, py_buffer_checkinteger)
+        case 'I': py_buffer_set(unsigned int, py_buffer_checkinteger)
+        case 'l': py_buffer_set(long, py_buffer_checkinteger)
+        case 'L': py_buffer_set(unsigned long, py_buffer_checkinteger)
+        case 'q': py_buffer_set(long long, py_buffer_checkinteger)
+        case 'Q': py_buffer_set(unsigned long long, py_buffer_checkinteger)
+        case 'f': py_buffer_set(float, luaL_checknumber)
+        case 'd': py_buffer_set(double, luaL_checknumber)
+    }
+    return 0;
+}
+
+static int py_buffer_len(lua_State *L)
+{
+    py_buffer *buf = py_buffer_check(L, 1);
+    lua_pushinteger(L, (lua_Integer)buf->n);
+    return 1;
+}
+
+/* buf:sub(i [, j]) copies elements i..j into a Lua string, with the same
+ * index rules as string.sub. */
+static int py_buffer_sub(lua_State *L)
+{
+    py_buffer *buf = py_buffer_check(L, 1);
+    lua_Number i = luaL_optnumber(L, 2, 1);
+    lua_Number j = luaL_optnumber(L, 3, -1);
+    lua_Number n = (lua_Number)buf->n;
+
+    if (i < 0) i = n + i + 1;
+    if (j < 0) j = n + j + 1;
+    if (i < 1) i = 1;
+    if (j > n) j = n;
+
+    if (i > j) {
+        lua_pushliteral(L, "");
+    } else {
+        Py_ssize_t size = buf->view.itemsize;
+        lua_pushlstring(L, (const char *)buf->view.buf + ((Py_ssize_t)i-1) * size,
+                        (size_t)(((Py_ssize_t)j - (Py_ssize_t)i + 1) * size));
+    }
+    return 1;
+}
+
+static int py_buffer_release(lua_State *L)
+{
+    py_buffer *buf = (py_buffer*) luaL_checkudata(L, 1, PBUFFER);
+    if (!buf->released) {
+        PyBuffer_Release(&buf->view);
+        buf->released = 1;
+    }
+    return 0;
+}
+
+static int py_buffer_tostring(lua_State *L)
+{
+    py_buffer *buf = (py_buffer*) luaL_checkudata(L, 1, PBUFFER);
+    if (buf->released)
+        lua_pushliteral(L, "python buffer (released)");
+    else
+        lua_pushfstring(L, "python buffer: %p", buf->view.buf);
+    return 1;
+}
+
+/* Only releasing the view needs Python; element access works on the
+ * exporter's memory and runs without the GIL. */
+make_pyentry(py_buffer_release);
+
+static const luaL_Reg py_buffer_mt[] =
+{
+    {"__newindex",  py_buffer_newindex},
+    {"__len",   py_buffer_len},
+    {"__tostring",  py_buffer_tostring},
+    {NULL, NULL}
+};
+
+static const luaL_Reg py_buffer_methods[] =
+{
+    {"sub",     py_buffer_sub},
+    {NULL, NULL}
+};
+
+/* python.buffer(obj) wraps any object exporting the buffer protocol.  The
+ * view is writable whenever the exporter allows it.  bytes reach Lua as
+ * strings, so a Lua string gives a read-only view of its own bytes. */
+static int py_buffer_new(lua_State *L)
+{
+    py_object *obj = luaPy_to_pobject(L, 1);
+    py_buffer *buf;
+    const char *fmt;
+    int flags = PyBUF_FORMAT | PyBUF_C_CONTIGUOUS;
+
+    if (!obj && lua_type(L, 1) != LUA_TSTRING)
+        return luaL_argerror(L, 1, "python object expected");
+
+    buf = (py_buffer*) lua_newuserdata(L, sizeof(py_buffer));
+    buf->released = 1;
+    luaL_getmetatable(L, PBUFFER);
+    lua_setmetatable(L, -2);
+
+    if (!obj) {
+        size_t len;
+        const char *s = lua_tolstring(L, 1, &len);
+        /* The view keeps the string alive. */
+#if LUA_VERSION_NUM >= 502
+        lua_pushvalue(L, 1);
+        lua_setuservalue(L, -2);
+#else
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, 1);
+        lua_rawseti(L, -2, 1);
+        lua_setfenv(L, -2);
+#endif
+        PyBuffer_FillInfo(&buf->view, NULL, (void *)s, (Py_ssize_t)len, 1,
+                          flags);
+        buf->released = 0;
+        buf->fmt = 'B';
+        buf->n = (Py_ssize_t)len;
+        return 1;
+    }
+
+    if (PyObject_GetBuffer(obj->o, &buf->view, flags | PyBUF_WRITABLE) < 0) {
+        PyErr_Clear();
+        if (PyObject_GetBuffer(obj->o, &buf->view, flags) < 0) {
+            PyErr_Clear();
+            return luaL_argerror(L, 1, "object does not support the buffer protocol");
+        }
+    }
+    buf->released = 0;
+
+    fmt = buf->view.format ? buf->view.format : "B";
+    if (*fmt == '@')
+        fmt++;
+    if (!fmt[0] || fmt[1] || !strchr("c?bBhHiIlLqQfd", fmt[0]) ||
+        buf->view.itemsize <= 0) {
+        PyBuffer_Release(&buf->view);
+        buf->released = 1;
+        return luaL_argerror(L, 1, "unsupported buffer format");
+    }
+    buf->fmt = fmt[0];
+    buf->n = buf->view.len / buf->view.itemsize;
+    return 1;
+}
+
+py_buffer* luaPy_to_pbuffer(lua_State *L, int n)
+{
+    if(!lua_getmetatable(L, n)) return NULL;
+    luaL_getmetatable(L, PBUFFER);
+    int is_pbuffer = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return is_pbuffer ? (py_buffer *) lua_touserdata(L, n) : NULL;
+}
+
+static int py_totable(lua_State *L)
+{
+    py_object *obj = luaPy_to_pobject(L, 1);
+    int deep = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+
+    if (!obj) {
+        luaL_checkany(L, 1);
+        lua_settop(L, 1);
+        return 1;
+    }
+
+    return py_convert_table(L, obj->o, deep);
+}
+
+/* python.map(f, t1 [, t2 ...]) calls f(t1[i], t2[i], ...) for each i up
+ * to the length of the shortest table, like Python's map, and returns the
+ * results in a new sequence.  The loop runs here, reusing one argument
+ * array for every call. */
+static int py_map(lua_State *L)
+{
+    py_object *obj = luaPy_to_pobject(L, 1);
+    int ntables = lua_gettop(L) - 1;
+    int i, k, n, res;
+    py_callargs a;
+
+    if (!obj)
+        return luaL_argerror(L, 1, "python object expected");
+    if (ntables < 1)
+        return luaL_argerror(L, 2, "table expected");
+    n = INT_MAX;
+    for (k = 2; k <= ntables + 1; k++) {
+        int len;
+        luaL_checktype(L, k, LUA_TTABLE);
+        len = (int)lua_rawlen(L, k);
+        if (len < n)
+            n = len;
+    }
+
+    lua_createtable(L, n, 0);
+    res = lua_gettop(L);
+    py_callargs_init(&a);
+    for (i = 1; i <= n; i++) {
+        PyObject *value;
+        if (!py_callargs_reserve(&a, ntables))
+            return luaL_error(L, "failed to allocate arguments");
+        for (k = 2; k <= ntables + 1; k++) {
+            PyObject *arg;
+            lua_rawgeti(L, k, i);
+            arg = LuaConvert(L, -1);
+            lua_pop(L, 1);
+            if (!arg) {
+                py_callargs_clear(&a);
+                PyErr_Clear();
+                return luaL_error(L, "failed to convert argument");
+            }
+            a.args[++a.n] = arg;
+        }
+        value = py_callargs_call(&a, obj->o);
+        if (!value)
+            return py_call_error(L);
+        k = py_convert(L, value);
+        Py_DECREF(value);
+        if (!k) {
+            PyErr_Print();
+            return luaL_error(L, "failed to convert return value");
+        }
+        lua_rawseti(L, res, i);
+    }
+    return 1;
+}
+
 py_object* luaPy_to_pobject(lua_State *L, int n)
 {
     if(!lua_getmetatable(L, n)) return NULL;
@@ -632,32 +1723,94 @@ py_object* luaPy_to_pobject(lua_State *L, int n)
     return is_pobject ? (py_object *) lua_touserdata(L, n) : NULL;
 }
 
+make_pyentry(py_execute);
+make_pyentry(py_eval);
+make_pyentry(py_asindx);
+make_pyentry(py_asattr);
+make_pyentry(py_asfunc);
+make_pyentry(py_locals);
+make_pyentry(py_globals);
+make_pyentry(py_builtins);
+make_pyentry(py_import);
+make_pyentry(py_totable);
+make_pyentry(py_buffer_new);
+make_pyentry(py_array);
+make_pyentry(py_map);
+
 static const luaL_Reg py_lib[] =
 {
-    {"execute", py_execute},
-    {"eval",    py_eval},
-    {"asindx",  py_asindx},
-    {"asattr",  py_asattr},
-    {"asfunc",  py_asfunc},
-    {"locals",  py_locals},
-    {"globals", py_globals},
-    {"builtins",    py_builtins},
-    {"import",  py_import},
+    {"execute", py_execute_entry},
+    {"eval",    py_eval_entry},
+    {"asindx",  py_asindx_entry},
+    {"asattr",  py_asattr_entry},
+    {"asfunc",  py_asfunc_entry},
+    {"locals",  py_locals_entry},
+    {"globals", py_globals_entry},
+    {"builtins",    py_builtins_entry},
+    {"import",  py_import_entry},
+    {"totable", py_totable_entry},
+    {"buffer",  py_buffer_new_entry},
+    {"array",   py_array_entry},
+    {"map",     py_map_entry},
     {NULL, NULL}
 };
 
+/* Set python.none on the module table on top of the stack, which is
+ * left as the single result. */
+static int py_open_none(lua_State *L)
+{
+    if (!py_convert_custom(L, Py_None, 0))
+      return luaL_error(L, "failed to convert none object");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "Py_None"); /* registry.Py_None */
+
+    lua_setfield(L, -2, "none"); /* python.none */
+
+    return 1;
+}
+
+make_pyentry(py_open_none);
+
 LUA_API int luaopen_python(lua_State *L)
 {
-    int rc;
+    /* Lua is the host: set before registering anything, so that every
+     * function using Python takes the GIL for itself, and before
+     * importing lua, so that the default state runs without it. */
+    if (!Py_IsInitialized())
+        LuaGILHost = 1;
 
     /* Register module */
-    luaL_newlib(L, py_lib);
+    lua_newtable(L);
+    LuaGIL_setfuncs(L, py_lib);
 
     /* Register python object metatable */
     luaL_newmetatable(L, POBJECT);
-    luaL_setfuncs(L, py_object_mt, 0);
+    LuaGIL_setfuncs(L, py_object_mt);
     lua_pop(L, 1);
 
+    /* Register python buffer metatable */
+    luaL_newmetatable(L, PBUFFER);
+    luaL_setfuncs(L, py_buffer_mt, 0);
+    lua_pushcfunction(L, py_buffer_release_entry);
+    LuaGIL_wrap(L);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, py_buffer_methods);
+    lua_pushcfunction(L, py_buffer_release_entry);
+    LuaGIL_wrap(L);
+    lua_setfield(L, -2, "release");
+    lua_pushcclosure(L, py_buffer_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    /* Register python exception metatable */
+    luaL_newmetatable(L, PEXCEPTION);
+    LuaGIL_setfuncs(L, py_exception_mt);
+    lua_pop(L, 1);
+
+    /* Register python array metatable */
+    luaopen_array(L);
+
     /* Initialize Lua state in Python territory */
     if (!LuaState) LuaState = L;
 
@@ -703,17 +1856,17 @@ LUA_API int luaopen_python(lua_State *L)
         maind = PyModule_GetDict(mainm);
         PyDict_SetItemString(maind, "lua", luam);
         Py_DECREF(luam);
-    }
-
-    /* Register 'none' */
-    rc = py_convert_custom(L, Py_None, 0);
-    if (!rc)
-      return luaL_error(L, "failed to convert none object");
-
-    lua_pushvalue(L, -1);
-    lua_setfield(L, LUA_REGISTRYINDEX, "Py_None"); /* registry.Py_None */
 
-    lua_setfield(L, -2, "none"); /* python.none */
+        py_open_none(L);
+        /* Other threads, each with its own Lua state, may now enter
+         * Python: every entry takes the GIL as it needs it. */
+        PyEval_SaveThread();
+        return 1;
+    }
 
+    lua_pushcfunction(L, py_open_none_entry);
+    LuaGIL_wrap(L);
+    lua_insert(L, -2);
+    lua_call(L, 1, 1);
     return 1;
 }
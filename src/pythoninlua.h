@@ -24,6 +24,8 @@
 #define PYTHONINLUA_H
 
 #define POBJECT "POBJECT"
+#define PBUFFER "PBUFFER"
+#define PEXCEPTION "PEXCEPTION"
 
 #if PY_MAJOR_VERSION < 3
   #define PyBytes_Check           PyString_Check
@@ -31,6 +33,8 @@
 #endif
 
 int py_convert(lua_State *L, PyObject *o);
+int py_convert_table(lua_State *L, PyObject *o, int deep);
+int py_register_encoder(PyObject *type, PyObject *func);
 
 typedef struct
 {
@@ -38,7 +42,28 @@ typedef struct
     int asindx;
 } py_object;
 
+/* Zero-copy view of a Python buffer-protocol object (python.buffer). */
+typedef struct
+{
+    Py_buffer view;
+    Py_ssize_t n;
+    char fmt;
+    int released;
+} py_buffer;
+
+/* Lua C functions that use Python are registered as func_entry, which
+ * holds the GIL while func runs (see LuaGIL_call), and go through
+ * LuaGIL_wrap or LuaGIL_setfuncs for Lua hosts. */
+#define make_pyentry(func) \
+  static int func ## _entry(lua_State *L) \
+  { \
+    return LuaGIL_call(L, func); \
+  } \
+  struct func ## __LINE__ // force semi
+
 py_object*    luaPy_to_pobject(lua_State *L, int n);
+py_buffer*    luaPy_to_pbuffer(lua_State *L, int n);
+PyObject*     luaPy_to_pexception(lua_State *L, int n);
 LUA_API int   luaopen_python(lua_State *L);
 
 #endif
@@ -21,15 +21,371 @@ True
 >>> lg.x['foo'][1], lg.x['foo'][2]
 (4..., 5...)
 
+>>> lua.eval("string.rep('ab', 40)") == 'ab' * 40
+True
+>>> lua.eval("'caf\\\\195\\\\169'") == u'caf\\xe9'
+True
+>>> lua.eval("'\\\\255\\\\254'") == b'\\xff\\xfe'
+True
+
+>>> lua.eval("'field'") is lua.eval("'fi' .. 'eld'")
+True
+>>> lua.execute("function mk(i) return 'k' .. i end")
+>>> all(lg.mk(i) == 'k%d' % i for i in range(5000))
+True
+
+>>> lua.string_mode("bytes")
+'str'
+>>> lua.eval("'abc'")
+b'abc'
+>>> lua.string_mode("lazy")
+'bytes'
+>>> s = lua.eval("string.rep('xy', 3)")
+>>> type(s).__name__, len(s), bytes(s)
+('LuaString', 6, b'xyxyxy')
+>>> s == 'xyxyxy', str(s), {'xyxyxy': 1}[s]
+(True, 'xyxyxy', 1)
+>>> lua.globals().string.upper(s) == 'XYXYXY'
+True
+>>> lua.string_mode("buffer")
+'lazy'
+>>> b = lua.eval("string.rep('z', 4)")
+>>> type(b).__name__, len(b), b == b'zzzz', hash(b) == hash(b'zzzz')
+('LuaBytes', 4, True, True)
+>>> m = memoryview(b)
+>>> m.readonly, m[0], bytes(m[1:3])
+(True, 122, b'zz')
+>>> lua.globals().string.len(b)
+4
+>>> lua.string_mode()
+'buffer'
+>>> other = lua.State()
+>>> other.string_mode(), other.eval("'abc'")
+('str', 'abc')
+>>> other.string_mode("bytes"), other.eval("'abc'"), lua.string_mode()
+('str', b'abc', 'buffer')
+>>> lua.string_mode("str")
+'buffer'
+>>> lua.string_mode("nope")
+Traceback (most recent call last):
+...
+ValueError: unknown string mode 'nope'
+
+>>> lua.eval("2^53 + 1") == 2**53 + 1
+False
+>>> lua.eval("9007199254740993")
+9007199254740993
+>>> lua.eval("3.0"), lua.eval("-7")
+(3.0, -7)
+>>> lg.big = 2**62 + 1
+>>> lua.eval("big == 4611686018427387905 and math.type(big)")
+'integer'
+>>> lg.huge = 2**64
+>>> lua.eval("math.type(huge)")
+'float'
+
+>>> lua.execute("nested = {1, {2, 3}, {a = {b = 'c'}}, n = false}")
+>>> lua.to_python(lg.nested) == {1: 1, 2: [2, 3], 3: {'a': {'b': 'c'}}, 'n': False}
+True
+>>> lua.to_python(lg.x['foo'])
+[4, 5]
+>>> lua.to_python(lg.nested, deep=False)[2]
+<Lua table at 0x...>
+>>> lua.to_python(lg.nested, max_depth=2)[3]['a']
+<Lua table at 0x...>
+>>> lua.execute("cyc = {1}; cyc[2] = cyc")
+>>> c = lua.to_python(lg.cyc)
+>>> c[1] is c
+True
+>>> lua.to_python(42)
+42
+
+>>> cfg = {'w': [1.5, 2], 'name': 'x', 'sub': {'k': (True,)}}
+>>> lg.cfg = lua.table(cfg)
+>>> lua.eval("#cfg.w == 2 and cfg.w[1] == 1.5 and cfg.sub.k[1]")
+True
+>>> lua.to_python(lg.cfg) == {'w': [1.5, 2], 'name': 'x', 'sub': {'k': [True]}}
+True
+>>> lg.shallow = lua.table(cfg, False)
+>>> lua.eval("type(shallow.w)")
+'userdata'
+>>> lg.nested = lua.table({'a': [1]}, deep=True)
+>>> lua.eval("nested.a[1]")
+1
+>>> lua.table(1)
+Traceback (most recent call last):
+...
+TypeError: dict, list or tuple expected
+
+>>> a = lua.array('float64', [1.0, 2.0, 3.5])
+>>> len(a), a[2], a.dtype, a.sum(), a.min(), a.max()
+(3, 3.5, 'float64', 6.5, 1.0, 3.5)
+>>> a.dot(a)
+17.25
+>>> a.scale(2); list(a)
+[2.0, 4.0, 7.0]
+>>> m = memoryview(a)
+>>> m.format, m.shape, m.tolist()
+('d', (3,), [2.0, 4.0, 7.0])
+>>> ai = a.__array_interface__
+>>> ai['shape'], ai['typestr'][1:], ai['version']
+((3,), 'f8', 3)
+>>> lg.a = a
+>>> lua.execute("a[1] = 0.5; a:axpy(1, a)")
+>>> list(a), lua.eval("#a"), lua.eval("a") is a
+([1.0, 8.0, 14.0], 3, True)
+>>> b = lua.array('uint8', 4)
+>>> b[0] = 256
+Traceback (most recent call last):
+...
+OverflowError: value out of range for array type
+>>> lua.eval("require('python').array('int32', {1, -2, 3})").sum()
+2
+
+>>> class Point:
+...     def __init__(self, x, y): self.x, self.y = x, y
+>>> lua.register_encoder(Point, lambda p: lua.table([p.x, p.y]))
+>>> lg.pt = Point(3, 4)
+>>> lua.eval("type(pt) == 'table' and pt[1] + pt[2]")
+7
+>>> class Celsius(float):
+...     def __tolua__(self): return self * 9 / 5 + 32
+>>> lg.temp = Celsius(100)
+>>> lua.eval("temp")
+212.0
+>>> from collections import namedtuple
+>>> Pair = namedtuple('Pair', 'a b')
+>>> lua.register_encoder(Pair, lambda p: p.a * 10 + p.b)
+>>> lg.pairs_ = lua.table({'p': Pair(1, 2), 'l': [Pair(3, 4)]})
+>>> lua.eval("pairs_.p + pairs_.l[1]")
+46
+>>> lua.register_encoder(Pair, None)
+>>> class Grab:
+...     def __init__(self, box): self.box = box
+>>> lua.register_encoder(Grab, lambda g: g.box.clear() or 'grabbed')
+>>> box = [0]
+>>> box[:] = [Grab(box), 'kept', 'too']
+>>> lg.grabbed = lua.table(box)
+>>> lua.eval("grabbed[1] .. ' ' .. grabbed[2] .. ' ' .. grabbed[3]")
+'grabbed kept too'
+>>> lua.register_encoder(Grab, None)
+>>> lua.register_encoder(Point, None)
+>>> lg.pt = Point(3, 4)
+>>> lua.eval("type(pt)")
+'userdata'
+>>> lua.execute("Vec = {}; v = setmetatable({x = 1, y = 2}, Vec)")
+>>> lua.register_decoder(lg.Vec, lambda t: (t.x, t.y))
+>>> lg.v, lua.eval("{1}")[1]
+((1, 2), 1)
+>>> lua.execute("Bad = {}")
+>>> lua.register_decoder(lg.Bad, lambda t: 1 / 0)
+>>> lg.pylen = len
+>>> lua.execute("function try_call(...) return select(2, pcall(pylen, ...)) end")
+>>> lua.eval("try_call(1, setmetatable({}, Bad))")
+'failed to convert argument #2'
+>>> lua.eval("try_call{k = setmetatable({}, Bad)}")
+"failed to convert argument 'k'"
+>>> lua.register_decoder(lg.Bad, None)
+
+>>> lua.execute("V = setmetatable({}, {__add = function(a, b) return 'added' end})")
+>>> lua.execute("W = setmetatable({n = 3}, {__unm = function(a) return -a.n end})")
+>>> lg.V + 1, 2 + lg.V, -lg.W
+('added', 'added', -3)
+>>> lg.string == lg.string, lg.string != lua.eval("string"), lg.string == 1
+(True, False, False)
+>>> lua.eval("{}") == lua.eval("{}")
+False
+>>> lg.string + object()
+Traceback (most recent call last):
+...
+TypeError: unsupported operand type(s) for +: 'lua.custom' and 'object'
+>>> lg.string + 1
+Traceback (most recent call last):
+...
+TypeError: unsupported operand type(s) for +: 'lua.custom' and 'int'
+>>> lg.V + True
+Traceback (most recent call last):
+...
+TypeError: unsupported operand type(s) for +: 'lua.custom' and 'bool'
+>>> lg.V + lg.string, lg.string + lg.V
+('added', 'added')
+
 >>> lua.require
 <built-in function require>
 
+>>> st = lua.State()
+>>> st
+<Lua state at 0x...>
+>>> st.execute("only_here = 'private'")
+>>> st.eval("only_here"), lua.eval("only_here")
+('private', None)
+>>> sg = st.globals()
+>>> sg.y = [1, 2]
+>>> st.eval("y[0] + #y"), st.bind("string.upper")("ok")
+(3, 'OK')
+>>> sg.f = lg.string.upper
+>>> st.eval("f('cross')"), st.eval("type(f)")
+('CROSS', 'userdata')
+>>> sg.string == lg.string
+False
+>>> st.eval("require('python').eval('abs')(-3)")
+3
+>>> st.eval("'field'") is st.eval("'fi' .. 'eld'")
+True
+>>> del sg, st
+
+>>> pool = lua.StatePool(2, init="limit = 10; function allow(n) return n <= limit end")
+>>> pool
+<Lua state pool of 2>
+>>> with pool.checkout() as st:
+...     st.execute("limit = 0; scratch = 1; allow = nil")
+...     st.eval("scratch")
+1
+>>> with pool.checkout() as a, pool.checkout() as b:
+...     a is not b, a.eval("allow(5) and limit"), a.eval("scratch")
+(True, 10, None)
+>>> pool.checkout(timeout=0) is not pool.checkout(timeout=0)
+True
+>>> pool.checkout(timeout=0)
+Traceback (most recent call last):
+...
+_queue.Empty
+>>> seeded = lua.StatePool(1, init=lambda st: st.execute("seed = 7"))
+>>> seeded.checkout().eval("seed")
+7
+
+>>> import threading, time
+>>> flags = lua.array('int32', 2)
+>>> spin = lua.eval('''function(a)
+...     a[2] = 1
+...     local t = os.clock() + 5
+...     while a[1] == 0 and os.clock() < t do end
+...     return a[1] ~= 0
+... end''')
+>>> seen = []
+>>> t = threading.Thread(target=lambda: seen.append(spin(flags)))
+>>> t.start()
+>>> while flags[1] == 0: time.sleep(0.001)
+>>> flags[0] = 1
+>>> t.join()
+>>> seen
+[True]
+>>> add1 = lua.eval("function(f, n) return f(n) + 1 end")
+>>> def work(n):
+...     seen.append(add1(abs, -n))
+>>> ts = [threading.Thread(target=work, args=(i,)) for i in range(8)]
+>>> for t in ts: t.start()
+>>> for t in ts: t.join()
+>>> sorted(seen[1:])
+[1, 2, 3, 4, 5, 6, 7, 8]
+>>> src = "function scale(x, k) return x * (k or 10) end"
+>>> lua.parallel_map(src, "scale", range(1000), workers=3, chunk=16) == [x * 10 for x in range(1000)]
+True
+>>> lua.parallel_map(src, "scale", [(1, 2), 3], workers=2, chunk=1), lua.parallel_map(src, "scale", [])
+([2, 30], [])
+>>> def swap(): items[:] = [(swap, -1)] * 4
+>>> items = [(swap, i) for i in range(4)]
+>>> lua.parallel_map("function f(swap, x) swap() return x end", "f", items, workers=1, chunk=1)
+[0, 1, 2, 3]
+>>> lua.parallel_map(src, "scale", [1, 2, 3], chunk=2**40), lua.parallel_map(src, "scale", [4], chunk=sys.maxsize)
+([10, 20, 30], [40])
+>>> lua.parallel_map("py = require 'python'; function f(x) return py.eval('abs')(x) end", "f", [-1, -2], workers=2)
+[1, 2]
+>>> lua.parallel_map(src, "nope", [1])
+Traceback (most recent call last):
+...
+LookupError: global 'nope' is not defined
+>>> lua.parallel_map("function f(x) if x == 77 then error('bad') end end", "f", range(100), workers=4, chunk=5)
+Traceback (most recent call last):
+...
+lua.LuaError: [string "<python>"]:1: bad
+>>> warm = lua.StatePool(2, init=src)
+>>> lua.parallel_map(None, "scale", range(6), chunk=2, pool=warm)
+[0, 10, 20, 30, 40, 50]
+>>> lua.parallel_map("k = 3; function triple(x) return x * k end", "triple", [1, 2], chunk=1, pool=warm)
+[3, 6]
+>>> a, b = warm.checkout(timeout=0), warm.checkout(timeout=0)
+>>> a.eval("triple"), b.eval("k"), b.eval("scale(1)")
+(None, None, 10)
+>>> del a, b
+
 >>> lg.string
 <Lua table at 0x...>
 >>> lg.string.lower
 <Lua function at 0x...>
 >>> lg.string.lower("Hello world!") == u'hello world!'
 True
+>>> lg.string.find("Hello", "l")
+(3, 3)
+>>> lg.string.find("Hello", "l", nresults=1)
+3
+>>> lg.string.find("Hello", "z", nresults=2)
+(None, None)
+>>> find = lua.bind("string.find", nresults=1)
+>>> find("Hello", "l"), find("Hello", "l", nresults=2)
+(3, (3, 3))
+>>> lua.bind("string.nope")
+Traceback (most recent call last):
+...
+TypeError: bound object is not callable
+>>> lua.bind("string.len.x")
+Traceback (most recent call last):
+...
+LookupError: cannot index a non-table at 'x'
+>>> lua.map(lg.string.rep, [("ab", 2), ("c", 3)])
+['abab', 'ccc']
+>>> lua.map(lua.eval("function(x) return x * 2, 'extra' end"), range(4))
+[0, 2, 4, 6]
+>>> def swap(): items[:] = [(swap, -1)] * 3
+>>> items = [(swap, i) for i in range(3)]
+>>> lua.map(lua.eval("function(swap, x) swap() return x end"), items)
+[0, 1, 2]
+>>> lua.map(lua.eval("error"), ["boom"])
+Traceback (most recent call last):
+...
+lua.LuaError: boom
+>>> odd = lua.eval("function(x) if x % 2 == 1 then return x * 10 end end")
+>>> s = lua.stream(odd, iter(range(1, 1000000)), chunk=4)
+>>> next(s), next(s), next(s)
+(10, 30, 50)
+>>> list(lua.stream(lg.string.rep, [("a", 2), ("b", 0)]))
+['aa', '']
+>>> list(lua.stream(lua.eval("error"), ["boom"]))
+Traceback (most recent call last):
+...
+lua.LuaError: boom
+>>> try:
+...     lua.execute("error({code = 42})")
+... except lua.LuaError as e:
+...     err = e
+>>> err.value.code, isinstance(err, RuntimeError), err.traceback
+(42, True, None)
+>>> lua.tracebacks(True)
+False
+>>> try:
+...     lua.execute("error({code = 42})")
+... except lua.LuaError as e:
+...     err = e
+>>> "stack traceback" in str(err.traceback)
+True
+>>> lua.tracebacks(False), lua.State().tracebacks()
+(True, False)
+>>> lua.execute("x = = 1")
+Traceback (most recent call last):
+...
+lua.LuaError: [string "<python>"]:1: unexpected symbol near '='
+>>> def fail(): raise KeyError("k")
+>>> lg.fail = fail
+>>> lua.eval("select(2, pcall(fail)).type")
+'KeyError'
+>>> lua.execute("fail()")
+Traceback (most recent call last):
+...
+KeyError: 'k'
+>>> lg.print("x", nresults=0, sep=1)
+Traceback (most recent call last):
+...
+TypeError: Lua functions only take the nresults keyword argument
 
 >>> d = {}
 >>> lg.d = d
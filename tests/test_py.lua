@@ -6,9 +6,18 @@ assert(false  == python.eval "False")
 
 assert(1   == python.eval "1")
 assert(1.5 == python.eval "1.5")
+if math.type then
+  assert(math.type(python.eval "1") == "integer")
+  assert(math.type(python.eval "1.0") == "float")
+  assert(python.eval "2**62 + 1" == 4611686018427387905)
+  assert(math.type(python.eval "2**64") == "float")
+  assert(tostring(python.eval "10**400") == "1" .. string.rep("0", 400))
+end
 
 assert("foo" == python.eval "b'foo'")
 assert("bar" == python.eval "u'bar'")
+assert("\xc3\xa9t\xc3\xa9" == python.eval "u'\\xe9t\\xe9'")
+assert("\xed\xa0\x80" == python.eval "u'\\ud800'")
 
 pyglob = python.globals()
 d = {}
@@ -25,6 +34,73 @@ assert(d.key == 'newvalue', d.key)
 l = python.eval "['hello']"
 assert(tostring(l * 3) == "['hello', 'hello', 'hello']")
 assert(tostring(l + python.eval "['bye']") == "['hello', 'bye']")
+assert(#l == 1 and l == python.eval "['hello']")
+
+local D = python.import("decimal").Decimal
+local x = D("7.5")
+assert(tostring(x % 2) == "1.5" and tostring(-x) == "-7.5")
+assert(tostring(x ^ 2) == "56.25")
+assert(x > D(1) and x <= D("7.5"))
+assert(x .. " USD" == "7.5 USD")
+if math.type then
+  -- Integer division, bitwise operators and mixed comparisons are 5.3+.
+  load([[
+    local x, a, b = ...
+    assert(tostring(x // 2) == "3" and not (x < 7))
+    assert(#(a & b) == 1 and #(a | b) == 3 and #(a ~ b) == 2)
+  ]])(x, python.eval "{1, 2}", python.eval "{2, 3}")
+end
+local ok, err = pcall(function() return x / D(0) end)
+assert(not ok and err.type == "DivisionByZero")
+
+-- Test native table conversion of py containers
+python.execute "cfg = {'rules': [{'w': 2}, {'w': 3}], 'on': True}"
+cfg = python.totable(python.globals().cfg)
+assert(type(cfg) == "table" and type(cfg.rules[2]) == "table")
+assert(#cfg.rules == 2 and cfg.rules[2].w == 3 and cfg.on == true)
+cfg = python.totable(python.globals().cfg, false)
+assert(type(cfg.rules) == "userdata")
+python.execute "cyc = [1]; cyc.append(cyc)"
+cyc = python.totable(python.eval "cyc")
+assert(cyc[2] == cyc)
+assert(python.totable(5) == 5)
+
+-- Test zero-copy buffer views
+python.execute "ba = bytearray(b'hello'); import array; arr = array.array('d', [0.5, 1.5])"
+buf = python.buffer(python.eval "ba")
+assert(#buf == 5 and buf[1] == 104 and buf[6] == nil)
+assert(buf:sub(2, 3) == "el" and buf:sub(-2) == "lo")
+buf[1] = 72
+assert(python.eval "ba == bytearray(b'Hello')")
+pyglob.view = buf
+assert(python.eval "view is ba")
+buf:release()
+assert(not pcall(function() return buf[1] end))
+arr = python.buffer(python.eval "arr")
+assert(#arr == 2 and arr[2] == 1.5)
+arr[1] = 2.25
+assert(python.eval "arr[0]" == 2.25)
+ro = python.buffer(python.eval "memoryview(b'xyz')")
+assert(ro[3] == 122)
+assert(not pcall(function() ro[1] = 1 end))
+bytes = python.buffer(python.eval "b'abc'")
+assert(#bytes == 3 and bytes[1] == 97 and bytes:sub(2) == "bc")
+assert(not pcall(function() bytes[1] = 1 end))
+big = python.buffer(python.eval "memoryview(array.array('Q', [2**64 - 1, 5]))")
+assert(big[1] > 0 and big[2] == 5)
+
+-- Test shared typed arrays
+v = python.array("float64", {1, 2, 3})
+w = python.array("float64", 3)
+assert(#v == 3 and v[2] == 2 and w[3] == 0 and v[4] == nil)
+w[1] = 4
+assert(v:dot(w) == 4 and v:sum() == 6 and v:max() == 3 and w:min() == 0)
+w:axpy(2, v)
+assert(w[1] == 6 and w[3] == 6)
+assert(python.builtins().len(v) == 3)
+ints = python.array("int64", {5, 7})
+assert(math.type == nil or math.type(ints[1]) == "integer")
+assert(not pcall(v.dot, v, ints))
 
 -- Test that Python C module can access Py Runtime symbols
 ctypes = python.import 'ctypes'
@@ -41,6 +117,23 @@ bar = 2
 assert(python.globals().foo == 1)
 assert(python.globals().bar == 2)
 
+python.execute
+[[
+def call_args(*args, **kw):
+    return repr((args, sorted(kw.items())))
+]]
+
+local call_args = python.globals().call_args
+assert(call_args(1, 2, 3) == "((1, 2, 3), [])")
+assert(call_args{1, 2, c=3} == "((1, 2), [('c', 3)])")
+assert(call_args(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) ==
+       "((1, 2, 3, 4, 5, 6, 7, 8, 9, 10), [])")
+assert(not pcall(call_args, {1, [true]=2}))
+
+local sums = python.map(python.eval("lambda a, b: a + b"), {1, 2, 3}, {10, 20})
+assert(#sums == 2 and sums[1] == 11 and sums[2] == 22)
+assert(#python.map(call_args, {}) == 0)
+
 python.execute
 [[
 def throw_exc():
@@ -49,6 +142,9 @@ def throw_exc():
 
 local status, exc = pcall(python.globals().throw_exc)
 assert(status == false)
+assert(exc.type == "Exception" and exc.message == "THIS EXCEPTION")
+assert(python.builtins().isinstance(exc.value, python.builtins().Exception))
+exc = tostring(exc)
 assert(exc ==
 [[error calling python function:
 Exception: Traceback (most recent call last):
@@ -65,3 +161,24 @@ end
 local exc_s = (string.sub(exc, oe+1))
 --assert((require "pl.stringx").strip(exc_s) == "THIS EXCEPTION");
 
+
+-- Python threads share the embedded interpreter with this host, but the
+-- host's own Lua state stays with the thread that entered Python from it
+python.execute
+[[
+import threading
+counted = []
+refused = []
+count = lua.eval("function(n) local s = 0 for i = 1, n do s = s + i end return s end")
+def work():
+    try:
+        count(1000)
+    except RuntimeError:
+        refused.append(True)
+workers = [threading.Thread(target=work) for i in range(4)]
+for w in workers: w.start()
+for w in workers: w.join()
+counted.append(count(1000))
+]]
+assert(python.eval "refused == [True] * 4")
+assert(python.eval "counted == [500500]")